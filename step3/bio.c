@@ -5,12 +5,14 @@
 #include "bio.h"
 
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "client.h"
 #include "log.h"
+#include "server.h"
 MSGDEF;
 
 // hex and dec
@@ -22,29 +24,98 @@ static inline int hex2int(char ch) {
 }
 static char hex[] = "0123456789abcdef";
 
-int fd;
+// connection to the disk server, each thread has its own
+__thread int fd;
 
 #define BSIZE 256
 
+// most read requests sent before waiting for replies
+#define NPIPE 16
+
 void bioinit(int serverfd) { fd = serverfd; }
 
+// replies from the disk server, may hold more than one line
+static __thread char ibuf[MSGSIZE];
+static __thread int ilen;
+
+// a request sent on the connection of the thread, waiting for its reply
+// the fibers of a worker share the connection, and the replies come in
+// the order of the requests
+struct req {
+    uchar *buf;   // read reply decoded here, or NULL
+    char *text;   // else the reply line, BSIZE bytes
+    int done;
+    void *fiber;  // the fiber waiting for it, or NULL
+    struct req *next;
+};
+static __thread struct req *head, *last;
+
+// queue r for the next reply, right when its request is sent
+static void expect(struct req *r, uchar *buf, char *text) {
+    *r = (struct req){buf, text, 0, fiber_self(), NULL};
+    if (last)
+        last->next = r;
+    else
+        head = r;
+    last = r;
+}
+
+static void decode(char *reply, uchar *buf);
+
+// receive replies from the disk server and hand each to its request
+// wait for at least one unless nowait is set
+static void take(int nowait) {
+    char *end;
+    while (!(end = memchr(ibuf, '\n', ilen))) {
+        if (ilen == MSGSIZE) errx(1, ERROR "reply too long");
+        int n = recv(fd, ibuf + ilen, MSGSIZE - ilen,
+                     nowait ? MSG_DONTWAIT : 0);
+        if (n < 0 && nowait && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0) err(1, ERROR "recv()");
+        if (n == 0) errx(1, ERROR "disk server closed");
+        ilen += n;
+    }
+    char *p = ibuf;
+    while ((end = memchr(p, '\n', ibuf + ilen - p))) {
+        *end = 0;
+        struct req *r = head;
+        if (!r) errx(1, ERROR "reply without request");
+        if (!(head = r->next)) last = NULL;
+        if (r->buf) decode(p, r->buf);
+        if (r->text) {
+            int len = end - p < BSIZE ? end - p : BSIZE - 1;
+            memcpy(r->text, p, len);
+            r->text[len] = 0;
+        }
+        r->done = 1;
+        if (r->fiber) fiber_wake(r->fiber);
+        p = end + 1;
+    }
+    ilen -= p - ibuf;
+    memmove(ibuf, p, ilen);
+}
+
+// wait for the reply to r; a fiber lets the others of its worker run
+// meanwhile, and whoever reads hands out the replies
+static void await(struct req *r) {
+    while (!r->done) take(fiber_wait(fd, POLLIN));
+}
+
 static int ncyl, nsec;
 void binfo(int *pncyl, int *pnsec) {
-    send(fd, "I\n", 3, 0);
-    int n = recv(fd, msg, 4096, 0);
-    if (n < 0) err(1, ERROR "recv()");
-    msg[n] = 0;
-    sscanf(msg, "%d %d", pncyl, pnsec);
+    struct req r;
+    char reply[BSIZE];
+    expect(&r, NULL, reply);
+    send(fd, "I\n", 2, 0);
+    await(&r);
+    sscanf(reply, "%d %d", pncyl, pnsec);
     ncyl = *pncyl, nsec = *pnsec;
 }
 
-void bread(int blockno, uchar *buf) {
-    msginit();
-    msgprintf("R %d %d\n", blockno / nsec, blockno % nsec);
-    msgsend(fd);
-    int n = recv(fd, msg, 4096, 0);
-    if (n < 0) err(1, ERROR "recv()");
-    char *data = &msg[4];  // "Yes xxxxx"
+// decode a read reply into buf
+static void decode(char *reply, uchar *buf) {
+    char *data = &reply[4];  // "Yes xxxxx"
     for (int i = 0; i < BSIZE; i++) {
         int a = hex2int(data[i * 2]);
         int b = hex2int(data[i * 2 + 1]);
@@ -55,20 +126,43 @@ void bread(int blockno, uchar *buf) {
     }
 }
 
+void bread(int blockno, uchar *buf) {
+    struct req r;
+    msginit();
+    msgprintf("R %d %d\n", blockno / nsec, blockno % nsec);
+    expect(&r, buf, NULL);
+    msgsend(fd);
+    await(&r);
+}
+
+void breadn(int n, int *blocknos, uchar *bufs) {
+    struct req r[NPIPE];
+    for (int i = 0; i < n; i += NPIPE) {
+        int m = n - i < NPIPE ? n - i : NPIPE;
+        msginit();
+        for (int j = 0; j < m; j++) {
+            int bno = blocknos[i + j];
+            msgprintf("R %d %d\n", bno / nsec, bno % nsec);
+            expect(&r[j], bufs + (i + j) * BSIZE, NULL);
+        }
+        msgsend(fd);
+        for (int j = 0; j < m; j++) await(&r[j]);
+    }
+}
+
 void bwrite(int blockno, uchar *buf) {
-    static char hexbuf[BSIZE * 2 + 1];
+    static __thread char hexbuf[BSIZE * 2 + 1];
     uchar *p = buf;
     for (int i = 0; i < BSIZE; i++) {
         hexbuf[i * 2] = hex[p[i] / 16];
         hexbuf[i * 2 + 1] = hex[p[i] % 16];
     }
     hexbuf[BSIZE * 2] = '\0';
+    struct req r;
     msginit();
     msgprintf("W %d %d %s\n", blockno / nsec, blockno % nsec, hexbuf);
     // printf("send %s\n", msg);
+    expect(&r, NULL, NULL);  // "Yes" or "No"
     msgsend(fd);
-    int n = recv(fd, msg, 4096, 0);  // recv "Yes" or "No"
-    if (n < 0) err(1, ERROR "recv()");
-    // msg[n] = 0;
-    // printf("Write recv: %s", msg);
+    await(&r);
 }
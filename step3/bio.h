@@ -7,9 +7,12 @@
 
 #include "common.h"
 
+// set the disk server connection of the calling thread
 void bioinit(int serverfd);
 void binfo(int *ncyl, int *nsec);
 void bread(int blockno, uchar *buf);
+// read n blocks into bufs, requests are pipelined
+void breadn(int n, int *blocknos, uchar *bufs);
 void bwrite(int blockno, uchar *buf);
 
 #endif
@@ -12,8 +12,7 @@ int main(int argc, char *argv[]) {
     while (1) {
         fgets(buf, sizeof(buf), stdin);
         if (feof(stdin)) break;
-        buf[strlen(buf) - 1] = 0;
-        send(fd, buf, strlen(buf), 0);
+        send(fd, buf, strlen(buf), 0);  // with the newline ending the command
         int n = recv(fd, buf, sizeof(buf), 0);
         if (n < 0) err(1, ERROR "recv");
         buf[n] = 0;
@@ -6,13 +6,17 @@ typedef unsigned short ushort;
 typedef unsigned int uint;
 
 #define MSGSIZE 4096
-#define MSGDEF static char msg[MSGSIZE], *msgtmp
+// one message buffer per thread
+#define MSGDEF static __thread char msg[MSGSIZE], *msgtmp
 #define msginit() msgtmp = msg
-#define msgprintf(...)                            \
-    do {                                          \
-        msgtmp += sprintf(msgtmp, ##__VA_ARGS__); \
+// what does not fit in msg is cut
+#define msgprintf(...)                                   \
+    do {                                                 \
+        int room = msg + MSGSIZE - msgtmp;               \
+        int len = snprintf(msgtmp, room, ##__VA_ARGS__); \
+        msgtmp += len < room ? len : room - 1;           \
     } while (0)
-#define msgsend(fd) send(fd, msg, msgtmp - msg, 0);
+#define msgsend(fd) send(fd, msg, msgtmp - msg, MSG_NOSIGNAL);
 
 #define ERROR "\033[31m[Error]\033[0m "
 
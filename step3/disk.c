@@ -149,6 +149,7 @@ static struct {
 };
 
 void *client_init(int connfd) { return NULL; }
+void client_exit(void *cli) {}
 
 int NCMD;
 int serve(int fd, char *buf, int len, void *) {
@@ -166,7 +167,7 @@ int serve(int fd, char *buf, int len, void *) {
     if (ret == 1) {
         PrtNo("No such command");
     }
-    msgsend(fd);
+    sendraw(msg, msgtmp - msg);
     return ret;
 }
 
@@ -201,7 +202,7 @@ int main(int argc, char *argv[]) {
 
     // command
     NCMD = sizeof(cmd_table) / sizeof(cmd_table[0]);
-    mainloop(atoi(argv[5]), client_init, serve);
+    mainloop(atoi(argv[5]), client_init, serve, client_exit);
 
     ret = munmap(diskfile, filesize);
     if (ret < 0) close(fd), err(1, ERROR "munmap");
@@ -1,11 +1,14 @@
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -14,13 +17,25 @@
 #include "common.h"
 #include "log.h"
 #include "server.h"
-MSGDEF;
+// the reply being built, in a buffer of each fiber, so that switching
+// fibers trades only the pointers
+static __thread char *msg, *msgtmp;
 
 typedef unsigned int uint;
 
 static inline uint min(uint a, uint b) { return a < b ? a : b; }
 static inline uint max(uint a, uint b) { return a < b ? b : a; }
 
+// parse a decimal argument into v
+// return -1 if it is not a number or does not fit
+static int parsenum(char *arg, unsigned long *v) {
+    char *end;
+    errno = 0;
+    *v = strtoul(arg, &end, 10);
+    if (end == arg || *end || *arg == '-' || errno) return -1;
+    return 0;
+}
+
 // Block size in bytes
 #define BSIZE 256
 
@@ -31,6 +46,7 @@ static inline uint max(uint a, uint b) { return a < b ? b : a; }
 enum {
     T_DIR = 1,   // Directory
     T_FILE = 2,  // File
+    T_IDX = 3,   // Hash index of a directory
 };
 
 struct dinode {               // 64 bytes
@@ -47,15 +63,29 @@ struct dinode {               // 64 bytes
 // inode in memory
 struct inode {
     uint inum;
-    ushort type : 2;          // File type: 0empty, 1dir or 2file
-    ushort mode : 4;          // File mode: rwrw for owner and others
-    ushort uid : 10;          // Owner id
-    ushort nlink;             // Number of links to inode
-    uint mtime;               // Last modified time
-    uint size;                // Size in bytes
-    uint blocks;              // Number of blocks, may be larger than size
-                              // not consider index blocks
-    uint addrs[NDIRECT + 2];  // Data block addresses
+    int ref;                    // Reference count, 0 if only cached
+    struct inode *prev, *next;  // LRU list of unreferenced inodes
+    struct inode *dnext;        // Next dirty inode
+    int dirty;                  // Changed since last iflush
+    struct imap *imap;          // Cached index blocks, NULL if none
+    uint dxidx;                 // Hash index inode of a directory, 0 if none
+    int dxread;                 // dxidx is read from the directory
+    struct freeslots *fslots;   // Deleted entries of a directory, or NULL
+    uint tailb;                 // Cached last data block, 0 if none
+    uchar *tail;                // Content of tailb
+    struct snap *snap;          // Committed version for readers, or NULL
+    int changed;                // Since snap was made
+    ushort type : 2;            // File type: 0empty, 1dir or 2file
+    ushort mode : 4;            // File mode: rwrw for owner and others
+    ushort uid : 10;            // Owner id
+    ushort nlink;               // Number of links to inode
+    uint mtime;                 // Last modified time
+    uint size;                  // Size in bytes
+    uint blocks;                // Number of blocks, may be larger than size
+                                // not consider index blocks
+    uint addrs[NDIRECT + 2];    // Data block addresses
+    pthread_rwlock_t lock;      // Shared by readers, held alone by writers
+    pthread_mutex_t mlock;      // Guards caches filled by readers: imap, dxidx
 };
 
 static inline void prtinode(struct inode *ip) {
@@ -82,6 +112,7 @@ struct superblock {
     uint ninodes;     // Number of inodes
     uint inodestart;  // Block number of first inode
     uint bmapstart;   // Block number of first free map block
+    uint refstart;    // Block number of first ref count block, 0 if none
 } sb;
 
 // total number of inodes
@@ -99,6 +130,61 @@ struct superblock {
 // addresses per block
 #define APB (BSIZE / sizeof(uint))
 
+// index blocks of an inode: 0 is the single indirect block,
+// 1 is the double indirect block, 2 + i is the i-th block under it
+#define NINDEX (2 + APB)
+
+// parts of the block map: 0 is the blocks up to the single indirect
+// block, 1 + i the blocks under the i-th slot of the double indirect block
+#define NPART (1 + APB)
+
+// cached index blocks of an inode
+struct imap {
+    uint *blk[NINDEX];    // Block contents, NULL if not loaded
+    uchar dirty[NINDEX];  // Changed since last iflush
+    uint first[APB + 1];  // First block under each double indirect slot
+    int firstok;          // first is valid
+    uint fill[NPART];     // Bytes in the blocks of each part
+    uchar fillok[NPART];  // fill[p] is valid
+};
+
+// a committed version of an inode, which ls and cat read without the
+// inode lock while writers go on; a writer publishes a new one when it
+// unlocks the inode, readers still holding the old one keep it
+// the data blocks of a version are pinned, so they are neither written
+// in place nor freed until it is dropped
+struct snap {
+    int ref;  // Readers holding it, and 1 while it is the current one
+    short type, mode, uid;
+    uint mtime, size;
+    uint nb;      // Data blocks holding size bytes, once e is filled
+    uint *e;      // Their entries, NULL until a reader needs them
+    uint *start;  // Start offset of each, start[nb] is the end
+};
+
+// an entry of a data block holds the block number in the low bits, and
+// the number of bytes used in the high bits, 0 for a full block
+// the content of a file is its blocks joined together, cut at size
+// block number 0 is a hole, which reads as zeros and takes no space
+#define BNOBITS 23
+#define BNO(e) ((e) & ((1u << BNOBITS) - 1))
+#define BFILL(e) ((e) >> BNOBITS ? (e) >> BNOBITS : BSIZE)
+#define BENT(b, fill) ((b) | ((fill) < BSIZE ? (uint)(fill) << BNOBITS : 0))
+
+// a slot of the double indirect block holds the index block number in
+// the low bits, and the number of entries in it in the high bits, 0 for
+// APB; inserts and deletes shift entries within the index blocks they
+// touch, so one may hold fewer
+// index block number 0 holds holes only
+#define ICNT(a) ((a) >> BNOBITS ? (a) >> BNOBITS : APB)
+#define IENT(b, n) ((b) | ((n) < APB ? (uint)(n) << BNOBITS : 0))
+
+// deleted entries of a directory, reused by icreate
+struct freeslots {
+    uint *slot;
+    int n, cap;
+};
+
 // block containing inode i
 #define IBLOCK(i) ((i) / IPB + sb.inodestart)
 // block of free map containing bit for block b
@@ -108,25 +194,37 @@ int fsize;
 int nblocks;
 int ninodesblocks = (NINODES / IPB) + 1;
 int nbitmap;
+int nrefs;
 int nmeta;
 
+// an open file of a client, which keeps the inode and its block map
+// cached, so commands on it skip the path lookup and permission check
+#define NHANDLE 16
+struct handle {
+    struct inode *ip;  // NULL if free
+    short perm;        // R and W granted by open
+    uint gen;          // fmtgen at open
+};
+uint fmtgen;  // bumped by format, which drops the inodes of older handles
+
 // things different from users
 struct clientitem {
     uint pwd;
     ushort uid;
+    struct handle h[NHANDLE];
 };
-struct clientitem *user;
+__thread struct clientitem *user;  // the client being served
 
 // init the clientitem
 void *client_init(int connfd) {
-    struct clientitem *cli = malloc(sizeof(struct clientitem));
+    struct clientitem *cli = calloc(1, sizeof(struct clientitem));
     cli->pwd = 0;
     cli->uid = 0;
     return cli;
 }
 
 // Disk layout:
-// [ superblock | inode blocks | free bit map | data blocks ]
+// [ superblock | inode blocks | free bit map | ref counts | data blocks ]
 
 // zero a block
 void bzro(uint bno) {
@@ -135,53 +233,478 @@ void bzro(uint bno) {
     bwrite(bno, buf);
 }
 
-// allocate a block
-uint balloc() {
-    for (int i = 0; i < sb.size; i += BPB) {
-        uchar buf[BSIZE];
-        bread(BBLOCK(i), buf);
-        for (int j = 0; j < BPB; j++) {
+// blocks read by one task of bfetch
+#define NFETCH 16
+
+struct fetch {
+    int n;
+    int *bnos;
+    uchar *bufs;
+};
+
+static void fetchrun(void *arg) {
+    struct fetch *f = arg;
+    breadn(f->n, f->bnos, f->bufs);
+}
+
+// read n blocks into bufs like breadn, split into runs of NFETCH blocks
+// that idle workers take and read on their own disk connections
+void bfetch(int n, int *bnos, uchar *bufs) {
+    if (n <= NFETCH) {
+        breadn(n, bnos, bufs);
+        return;
+    }
+    int nf = (n + NFETCH - 1) / NFETCH;
+    struct fetch *f = malloc(nf * sizeof(struct fetch));
+    taskgroup g = TASKGROUP_INIT;
+    for (int i = 0; i < nf; i++) {
+        int first = i * NFETCH;
+        f[i] = (struct fetch){min(n - first, NFETCH), bnos + first,
+                              bufs + first * BSIZE};
+        task_spawn(&g, fetchrun, &f[i]);
+    }
+    task_wait(&g);
+    free(f);
+}
+
+// a mutex belongs to the thread, so the fiber holding one must not let
+// the other commands of its worker run
+static inline void acquire(pthread_mutex_t *m) {
+    fiber_hold(1);
+    pthread_mutex_lock(m);
+}
+static inline void release(pthread_mutex_t *m) {
+    pthread_mutex_unlock(m);
+    fiber_hold(-1);
+}
+
+// guards the free map and the ref count table
+// recursive, so a caller can hold it across a few of the calls below
+static pthread_mutex_t alloclock;
+
+static uchar **ftab;  // cached blocks of the free map, NULL if not read
+static void tabload();
+
+// alloc up to n free blocks into bnos, from block goal on, so a file
+// grows contiguously; each bitmap block is written once
+// blocks are not zeroed, they are for data written before read
+// return the number of blocks alloced
+int ballocn(uint goal, int n, uint *bnos) {
+    uint nbb = (sb.size + BPB - 1) / BPB;
+    int got = 0;
+    if (goal >= sb.size) goal = 0;
+    tabload();
+    acquire(&alloclock);
+    // the last round goes back to the start of the first bitmap block
+    for (uint t = 0; t <= nbb && got < n; t++) {
+        uint i = (goal / BPB + t) % nbb * BPB;
+        int changed = 0;
+        uchar *buf = ftab[i / BPB];
+        for (uint j = t ? 0 : goal % BPB; j < BPB && i + j < sb.size; j++) {
             int m = 1 << (j % 8);
             if ((buf[j / 8] & m) == 0) {
                 buf[j / 8] |= m;
-                bwrite(BBLOCK(i), buf);
-                bzro(i + j);
-                return i + j;
+                bnos[got++] = i + j;
+                changed = 1;
+                if (got == n) break;
             }
         }
+        // written under the lock, so the writes of a block reach the disk
+        // in the order of its changes
+        if (changed) bwrite(BBLOCK(i), buf);
     }
-    Warn("balloc: out of blocks");
-    return 0;
+    release(&alloclock);
+    if (got < n) Warn("balloc: out of blocks");
+    return got;
 }
 
-// free a block
-void bfree(uint bno) {
-    uchar buf[BSIZE];
-    bread(BBLOCK(bno), buf);
-    int i = bno % BPB;
-    int m = 1 << (i % 8);
-    if ((buf[i / 8] & m) == 0) Warn("freeing free block");
-    buf[i / 8] &= ~m;
-    bwrite(BBLOCK(bno), buf);
+// alloc a zeroed block
+uint balloc() {
+    uint b;
+    if (!ballocn(0, 1, &b)) return 0;
+    bzro(b);
+    return b;
+}
+
+// blocks waiting to be cleared in the free map
+// collect them with bfree_add, then clear them with bfree_flush
+struct bfreelist {
+    uint *bnos;
+    int n, cap;
+};
+
+// add a block to the free list
+void bfree_add(struct bfreelist *fl, uint bno) {
+    if (bno == 0) return;  // a hole
+    if (fl->n == fl->cap) {
+        fl->cap = fl->cap ? fl->cap * 2 : 64;
+        fl->bnos = realloc(fl->bnos, fl->cap * sizeof(uint));
+    }
+    fl->bnos[fl->n++] = bno;
+}
+
+// pinned data blocks, held by snaps: a write to one goes to a new block,
+// and freeing it is put off until no snap holds it
+#define NPIN 256
+struct pin {
+    uint b;
+    int n;        // Snaps holding it
+    int retired;  // Freed while pinned
+    struct pin *next;
+};
+static struct pin *pins[NPIN];
+static struct bfreelist unpinned;  // retired blocks no snap holds now
+// guards the pins, nothing else is taken under it
+static pthread_mutex_t pinlock = PTHREAD_MUTEX_INITIALIZER;
+
+// where the pin of block b is, the caller holds pinlock
+static struct pin **pinslot(uint b) {
+    struct pin **pp = &pins[b % NPIN];
+    while (*pp && (*pp)->b != b) pp = &(*pp)->next;
+    return pp;
+}
+
+// pin the blocks of the n entries e, taking pinlock once
+// the new pins are alloced before it is taken
+static void bpinall(uint *e, uint n) {
+    struct pin **np = malloc((n + 1) * sizeof(struct pin *));
+    for (uint i = 0; i < n; i++)
+        np[i] = BNO(e[i]) ? calloc(1, sizeof(struct pin)) : NULL;
+    acquire(&pinlock);
+    for (uint i = 0; i < n; i++) {
+        if (!BNO(e[i])) continue;
+        struct pin **pp = pinslot(BNO(e[i]));
+        if (!*pp) {
+            np[i]->b = BNO(e[i]);
+            *pp = np[i];
+            np[i] = NULL;
+        }
+        (*pp)->n++;
+    }
+    release(&pinlock);
+    for (uint i = 0; i < n; i++) free(np[i]);
+    free(np);
+}
+
+// unpin the blocks of the n entries e, taking pinlock once
+// a retired block is freed by the next bfree_unpinned
+static void bunpinall(uint *e, uint n) {
+    struct pin *gone = NULL;  // freed after the lock
+    acquire(&pinlock);
+    for (uint i = 0; i < n; i++) {
+        if (!BNO(e[i])) continue;
+        struct pin **pp = pinslot(BNO(e[i])), *p = *pp;
+        if (p && --p->n == 0) {
+            if (p->retired) bfree_add(&unpinned, p->b);
+            *pp = p->next;
+            p->next = gone;
+            gone = p;
+        }
+    }
+    release(&pinlock);
+    while (gone) {
+        struct pin *p = gone;
+        gone = p->next;
+        free(p);
+    }
+}
+
+static int bpinned(uint b) {
+    acquire(&pinlock);
+    int pinned = *pinslot(b) != NULL;
+    release(&pinlock);
+    return pinned;
+}
+
+// leave block b, no longer used by any file, to be freed when unpinned
+// return 0 if it is not pinned, then the caller frees it
+static int bretire(uint b) {
+    acquire(&pinlock);
+    struct pin *p = *pinslot(b);
+    if (p) p->retired = 1;
+    release(&pinlock);
+    return p != NULL;
+}
+
+// forget all pins, the retired blocks too, as format frees everything
+static void pinclear() {
+    for (int i = 0; i < NPIN; i++)
+        while (pins[i]) {
+            struct pin *p = pins[i];
+            pins[i] = p->next;
+            free(p);
+        }
+    free(unpinned.bnos);
+    unpinned = (struct bfreelist){0};
+}
+
+static int cmp_uint(const void *a, const void *b) {
+    uint x = *(uint *)a, y = *(uint *)b;
+    return x < y ? -1 : x > y;
+}
+
+// ref count table, one byte per block: the number of other files
+// sharing the data block, 0 if only one file uses it
+// disks formatted without the table have sb.refstart 0 and never share
+#define MAXREF 255
+
+static uchar **rtab;   // cached blocks of the table, NULL if not read
+static uchar *rdirty;  // changed since last rflush
+
+static void rtaballoc() {
+    if (rtab) return;
+    rtab = calloc(sb.size / BSIZE + 1, sizeof(uchar *));
+    rdirty = calloc(sb.size / BSIZE + 1, 1);
+}
+
+// the cached table block holding the count of block b
+// the caller holds alloclock, as for bref and brefadd, and has called
+// tabload, so that nothing is read under it
+static uchar *rblk(uint b) {
+    rtaballoc();
+    uint i = b / BSIZE;
+    if (!rtab[i]) {
+        rtab[i] = malloc(BSIZE);
+        bread(sb.refstart + i, rtab[i]);
+    }
+    return rtab[i];
+}
+
+// number of other files sharing block b
+static inline int bref(uint b) {
+    return sb.refstart && b ? rblk(b)[b % BSIZE] : 0;
+}
+
+// add d to the count of block b, written by rflush
+static void brefadd(uint b, int d) {
+    rblk(b)[b % BSIZE] += d;
+    rdirty[b / BSIZE] = 1;
+}
+
+// write the changed blocks of the table
+void rflush() {
+    acquire(&alloclock);
+    for (uint i = 0; rtab && i <= sb.size / BSIZE; i++)
+        if (rdirty[i]) {
+            bwrite(sb.refstart + i, rtab[i]);
+            rdirty[i] = 0;
+        }
+    release(&alloclock);
+}
+
+// read the free map and the ref count table into the caches, once
+// the reads are done without alloclock, so the allocs of other commands
+// do not wait for the disk; blocks cached meanwhile by rblk are kept
+static void tabload() {
+    acquire(&alloclock);
+    int done = ftab != NULL;
+    release(&alloclock);
+    if (done) return;
+    int nbb = (sb.size + BPB - 1) / BPB;
+    int nrb = sb.refstart ? sb.size / BSIZE + 1 : 0;
+    int *bnos = malloc((nbb + nrb) * sizeof(int));
+    uchar *bufs = malloc((nbb + nrb) * BSIZE);
+    for (int i = 0; i < nbb; i++) bnos[i] = sb.bmapstart + i;
+    for (int i = 0; i < nrb; i++) bnos[nbb + i] = sb.refstart + i;
+    breadn(nbb + nrb, bnos, bufs);
+
+    acquire(&alloclock);
+    if (!ftab) {  // else another command got there first
+        ftab = malloc(nbb * sizeof(uchar *));
+        for (int i = 0; i < nbb; i++) {
+            ftab[i] = malloc(BSIZE);
+            memcpy(ftab[i], bufs + i * BSIZE, BSIZE);
+        }
+        rtaballoc();
+        for (int i = 0; i < nrb; i++) {
+            if (rtab[i]) continue;
+            rtab[i] = malloc(BSIZE);
+            memcpy(rtab[i], bufs + (nbb + i) * BSIZE, BSIZE);
+        }
+    }
+    release(&alloclock);
+    free(bnos);
+    free(bufs);
+}
+
+// drop the cached tables, after format
+void rinval() {
+    if (ftab) {
+        for (uint i = 0; i < (sb.size + BPB - 1) / BPB; i++) free(ftab[i]);
+        free(ftab);
+        ftab = NULL;
+    }
+    if (!rtab) return;
+    for (uint i = 0; i <= sb.size / BSIZE; i++) free(rtab[i]);
+    free(rtab);
+    free(rdirty);
+    rtab = NULL;
+    rdirty = NULL;
+}
+
+// free all blocks in the list
+// blocks sharing a free map block are cleared with one write
+void bfree_flush(struct bfreelist *fl) {
+    tabload();
+    acquire(&alloclock);
+    // shared blocks just lose a user, pinned ones are freed later
+    int n = 0;
+    for (int i = 0; i < fl->n; i++)
+        if (bref(fl->bnos[i]))
+            brefadd(fl->bnos[i], -1);
+        else if (!bretire(fl->bnos[i]))
+            fl->bnos[n++] = fl->bnos[i];
+    fl->n = n;
+    qsort(fl->bnos, fl->n, sizeof(uint), cmp_uint);
+    for (int i = 0, j; i < fl->n; i = j) {
+        uint bb = BBLOCK(fl->bnos[i]);
+        uchar *buf = ftab[fl->bnos[i] / BPB];
+        for (j = i; j < fl->n && BBLOCK(fl->bnos[j]) == bb; j++) {
+            int k = fl->bnos[j] % BPB;
+            int m = 1 << (k % 8);
+            if ((buf[k / 8] & m) == 0) Warn("freeing free block");
+            buf[k / 8] &= ~m;
+        }
+        bwrite(bb, buf);
+    }
+    release(&alloclock);
+    Debug("bfree_flush: %d blocks", fl->n);
+    free(fl->bnos);
+    fl->bnos = NULL;
+    fl->n = fl->cap = 0;
+}
+
+// free the retired blocks that are not pinned anymore
+void bfree_unpinned() {
+    acquire(&pinlock);
+    struct bfreelist fl = unpinned;
+    unpinned = (struct bfreelist){0};
+    release(&pinlock);
+    if (fl.n) bfree_flush(&fl);
+}
+
+// in-memory inode cache, indexed by inum
+// referenced inodes stay here, and at most NLRU unreferenced ones are kept
+#define NLRU 64
+struct inode *icache[NINODES];
+struct inode lru = {.prev = &lru, .next = &lru};  // head is most recent
+int nlru;
+struct inode *dirtylist;  // inodes waiting for iflush
+// guards icache, the LRU list, ref of every inode and the dirty list
+static pthread_mutex_t icachelock = PTHREAD_MUTEX_INITIALIZER;
+// inodes dropped from icache, so that an inode block read without
+// icachelock can be told to be older than an inode written and dropped
+// meanwhile
+static uint nevict;
+static pthread_mutexattr_t recursive;  // for mlock and alloclock
+
+void iupdate(struct inode *ip);
+void iflush();
+void idel(struct inode *ip);
+
+// take a rwlock, for writing if write is set
+// while it is busy the other commands of the worker go on
+static void rwlock(pthread_rwlock_t *l, int write) {
+    while (write ? pthread_rwlock_trywrlock(l) : pthread_rwlock_tryrdlock(l))
+        if (!fiber_wait(-1, 0)) {
+            write ? pthread_rwlock_wrlock(l) : pthread_rwlock_rdlock(l);
+            return;
+        }
+}
+
+static void snappub(struct inode *ip);
+void snapput(struct inode *ip, struct snap *s);
+static void snapfree(struct snap *s);
+
+// lock an inode for writing its content, map or fields
+// readers of its snap go on meanwhile, it is made now if there is none
+static inline void ilock(struct inode *ip) {
+    rwlock(&ip->lock, 1);
+    if (!ip->snap) snappub(ip);
+}
+// lock an inode for reading, shared with other readers
+static inline void ilockr(struct inode *ip) { rwlock(&ip->lock, 0); }
+// a writer that changed the inode publishes its new snap
+static inline void iunlock(struct inode *ip) {
+    if (ip->changed) snappub(ip);
+    pthread_rwlock_unlock(&ip->lock);
+}
+
+static inline void lru_del(struct inode *ip) {
+    ip->prev->next = ip->next;
+    ip->next->prev = ip->prev;
+    nlru--;
+}
+
+static inline void lru_add(struct inode *ip) {
+    ip->next = lru.next;
+    ip->prev = &lru;
+    lru.next->prev = ip;
+    lru.next = ip;
+    nlru++;
+}
+
+// a new in-memory inode
+static struct inode *inew(uint inum) {
+    struct inode *ip = calloc(1, sizeof(struct inode));
+    ip->inum = inum;
+    pthread_rwlock_init(&ip->lock, NULL);
+    pthread_mutex_init(&ip->mlock, &recursive);
+    return ip;
+}
+
+// free an in-memory inode and its cached index blocks
+static void ifreemem(struct inode *ip) {
+    if (ip->imap)
+        for (int k = 0; k < NINDEX; k++) free(ip->imap->blk[k]);
+    free(ip->imap);
+    if (ip->fslots) free(ip->fslots->slot);
+    free(ip->fslots);
+    free(ip->tail);
+    if (ip->snap) snapfree(ip->snap);
+    pthread_rwlock_destroy(&ip->lock);
+    pthread_mutex_destroy(&ip->mlock);
+    free(ip);
 }
 
 // get the inode with inum
-// remember to free it!
+// remember to iput it!
 // return NULL if not found
 struct inode *iget(uint inum) {
     if (inum < 0 || inum >= sb.ninodes) {
         Warn("iget: inum %d out of range", inum);
         return NULL;
     }
+    struct inode *ip;
     uchar buf[BSIZE];
-    bread(IBLOCK(inum), buf);
+    acquire(&icachelock);
+    for (;;) {
+        if ((ip = icache[inum])) {
+            if (ip->type == 0) {  // freed but still cached
+                release(&icachelock);
+                Warn("iget: no such inode");
+                return NULL;
+            }
+            if (ip->ref++ == 0) lru_del(ip);
+            release(&icachelock);
+            return ip;
+        }
+        // read without the lock, so other commands do not wait for it
+        uint ev = nevict;
+        release(&icachelock);
+        bread(IBLOCK(inum), buf);
+        acquire(&icachelock);
+        // cached meanwhile, or maybe cached, written and dropped
+        if (!icache[inum] && nevict == ev) break;
+    }
     struct dinode *dip = (struct dinode *)buf + inum % IPB;
     if (dip->type == 0) {
+        release(&icachelock);
         Warn("iget: no such inode");
         return NULL;
     }
-    struct inode *ip = calloc(1, sizeof(struct inode));
-    ip->inum = inum;
+    ip = inew(inum);
+    ip->ref = 1;
     ip->type = dip->type;
     ip->mode = dip->mode;
     ip->uid = dip->uid;
@@ -190,196 +713,1262 @@ struct inode *iget(uint inum) {
     ip->size = dip->size;
     ip->blocks = dip->blocks;
     memcpy(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    icache[inum] = ip;
+    release(&icachelock);
     Debug("iget: inum %d", inum);
     prtinode(ip);
     return ip;
 }
 
+// drop the least recently used unreferenced inodes when too many
+// dirty ones are kept until iflush has written them
+// the caller holds icachelock
+static void lru_trim() {
+    while (nlru > NLRU && !lru.prev->dirty) {
+        struct inode *old = lru.prev;
+        lru_del(old);
+        icache[old->inum] = NULL;
+        nevict++;
+        ifreemem(old);
+    }
+}
+
+// release an inode from iget or ialloc
+// a removed file that is still open is freed by its last iput
+void iput(struct inode *ip) {
+    acquire(&icachelock);
+    if (ip->ref == 1 && ip->type == T_FILE && ip->nlink == 0) {
+        release(&icachelock);
+        ilock(ip);  // no one else can find it, but iflush may be writing it
+        idel(ip);
+        iunlock(ip);
+        acquire(&icachelock);
+    }
+    if (--ip->ref == 0) {
+        lru_add(ip);
+        lru_trim();
+    }
+    release(&icachelock);
+}
+
+static inline void iunlockput(struct inode *ip) {
+    iunlock(ip);
+    iput(ip);
+}
+
+// drop all cached inodes, used when the disk is formatted
+// the inode block written last, so that updating the same inodes again
+// needs no read; all inode writes go through iflush
+static uint lastib;
+static uchar lastibuf[BSIZE];
+
+void iinval() {
+    while (nlru > 0) lru_del(lru.next);
+    for (int i = 0; i < NINODES; i++) {
+        if (!icache[i]) continue;
+        if (icache[i]->ref) Warn("iinval: inode %d in use", i);
+        ifreemem(icache[i]);
+        icache[i] = NULL;
+        nevict++;
+    }
+    dirtylist = NULL;
+    lastib = 0;
+}
+
 // allocate an inode
-// remember to free it!
+// remember to iput it!
 // return NULL if no inode is available
+static void dirty_add(struct inode *ip);
+
 struct inode *ialloc(short type) {
     uchar buf[BSIZE];
+    uint bno = 0, ev = 0;  // inode block in buf, and nevict when read
+    acquire(&icachelock);
     for (int i = 0; i < sb.ninodes; i++) {
-        bread(IBLOCK(i), buf);
-        struct dinode *dip = (struct dinode *)buf + i % IPB;
-        if (dip->type == 0) {
-            memset(dip, 0, sizeof(struct dinode));
-            dip->type = type;
-            bwrite(IBLOCK(i), buf);
-            struct inode *ip = calloc(1, sizeof(struct inode));
-            ip->inum = i;
-            ip->type = type;
-            Debug("ialloc: inum %d, type=%d", i, type);
-            prtinode(ip);
-            return ip;
+        struct inode *ip = icache[i];
+        if (ip) {
+            if (ip->type || ip->ref) continue;  // in use
+            lru_del(ip);  // freed but still cached, reuse it
+            if (ip->fslots) free(ip->fslots->slot);
+            free(ip->fslots);
+            ip->fslots = NULL;
+            if (ip->snap) snapfree(ip->snap);
+            ip->snap = NULL;
+        } else {
+            if (IBLOCK(i) != bno || nevict != ev) {
+                // read without the lock, then look at inode i again, as
+                // another command may have taken it meanwhile
+                ev = nevict;
+                release(&icachelock);
+                bread(bno = IBLOCK(i), buf);
+                acquire(&icachelock);
+                i--;
+                continue;
+            }
+            struct dinode *dip = (struct dinode *)buf + i % IPB;
+            if (dip->type != 0) continue;
+            ip = inew(i);
+            icache[i] = ip;
         }
+        ip->ref = 1;
+        ip->type = type;
+        ip->dxidx = ip->dxread = 0;
+        ip->mtime = time(NULL);
+        dirty_add(ip);  // written by iflush
+        release(&icachelock);
+        Debug("ialloc: inum %d, type=%d", i, type);
+        prtinode(ip);
+        return ip;
     }
+    release(&icachelock);
     Error("ialloc: no inodes");
     return NULL;
 }
 
-// write the inode to disk
+// mark the inode as changed
+// it is written to disk by the next iflush
 void iupdate(struct inode *ip) {
-    uchar buf[BSIZE];
-    bread(IBLOCK(ip->inum), buf);
-    struct dinode *dip = (struct dinode *)buf + ip->inum % IPB;
-    dip->type = ip->type;
-    dip->mode = ip->mode;
-    dip->uid = ip->uid;
-    dip->nlink = ip->nlink;
-    dip->mtime = ip->mtime = time(NULL);
-    dip->size = ip->size;
-    dip->blocks = ip->blocks;
-    memcpy(dip->addrs, ip->addrs, sizeof(ip->addrs));
-    bwrite(IBLOCK(ip->inum), buf);
+    ip->mtime = time(NULL);
+    ip->changed = 1;  // a new snap is published by iunlock
+    acquire(&icachelock);
+    dirty_add(ip);
+    release(&icachelock);
 }
 
-// free all data blocks of an inode, but not the inode itself
-void itrunc(struct inode *ip) {
+// put the inode on the dirty list, the caller holds icachelock
+static void dirty_add(struct inode *ip) {
+    if (ip->dirty) return;
+    ip->dirty = 1;
+    ip->dnext = dirtylist;
+    dirtylist = ip;
+}
+
+static int cmp_iblock(const void *a, const void *b) {
+    uint x = (*(struct inode **)a)->inum, y = (*(struct inode **)b)->inum;
+    return x < y ? -1 : x > y;
+}
+
+static uint *iaddr(struct inode *ip, int k, int alloc);
+
+// write the changed index blocks of an inode
+static void iflushmap(struct inode *ip) {
+    acquire(&ip->mlock);
+    if (ip->imap)
+        for (int k = 0; k < NINDEX; k++)
+            if (ip->imap->dirty[k]) {
+                bwrite(BNO(*iaddr(ip, k, 0)), (uchar *)ip->imap->blk[k]);
+                ip->imap->dirty[k] = 0;
+            }
+    release(&ip->mlock);
+}
+
+// write all dirty inodes to disk
+// inodes sharing an inode block are written together
+// an inode locked by another command is left for the flush after it
+// the caller must not hold any inode lock
+static pthread_mutex_t flushlock = PTHREAD_MUTEX_INITIALIZER;  // lastib
+
+void iflush() {
+    // take the dirty list, with a ref so the inodes stay cached
+    acquire(&icachelock);
+    int n = 0;
+    for (struct inode *ip = dirtylist; ip; ip = ip->dnext) n++;
+    if (n == 0) {
+        release(&icachelock);
+        return;
+    }
+    struct inode **ips = malloc(n * sizeof(struct inode *));
+    n = 0;
+    for (struct inode *ip = dirtylist; ip; ip = ip->dnext) {
+        ips[n++] = ip;
+        ip->dirty = 0;
+        if (ip->ref++ == 0) lru_del(ip);
+    }
+    dirtylist = NULL;
+    release(&icachelock);
+
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (pthread_rwlock_tryrdlock(&ips[i]->lock) == 0) {
+            ips[m++] = ips[i];
+            continue;
+        }
+        acquire(&icachelock);
+        dirty_add(ips[i]);
+        release(&icachelock);
+        iput(ips[i]);
+    }
+    n = m;
+    qsort(ips, n, sizeof(struct inode *), cmp_iblock);
+
+    acquire(&flushlock);
+    for (int i = 0; i < n; i++) iflushmap(ips[i]);
     uchar buf[BSIZE];
+    for (int i = 0, j; i < n; i = j) {
+        uint ib = IBLOCK(ips[i]->inum);
+        if (ib == lastib)
+            memcpy(buf, lastibuf, BSIZE);
+        else
+            bread(ib, buf);
+        for (j = i; j < n && IBLOCK(ips[j]->inum) == ib; j++) {
+            struct inode *ip = ips[j];
+            struct dinode *dip = (struct dinode *)buf + ip->inum % IPB;
+            dip->type = ip->type;
+            dip->mode = ip->mode;
+            dip->uid = ip->uid;
+            dip->nlink = ip->nlink;
+            dip->mtime = ip->mtime;
+            dip->size = ip->size;
+            dip->blocks = ip->blocks;
+            memcpy(dip->addrs, ip->addrs, sizeof(ip->addrs));
+        }
+        bwrite(ib, buf);
+        lastib = ib;
+        memcpy(lastibuf, buf, BSIZE);
+    }
+    release(&flushlock);
+    Debug("iflush: %d inodes", n);
+    for (int i = 0; i < n; i++) iunlockput(ips[i]);
+    free(ips);
+}
+
+static uint *iblk(struct inode *ip, int k, int alloc);
+
+// where the address of index block k is stored
+// return NULL if its parent is not allocated
+static uint *iaddr(struct inode *ip, int k, int alloc) {
+    if (k < 2) return &ip->addrs[NDIRECT + k];
+    uint *top = iblk(ip, 1, alloc);
+    return top ? &top[k - 2] : NULL;
+}
+
+// mark index block k as changed
+static inline void idirty(struct inode *ip, int k) {
+    ip->imap->dirty[k] = 1;
+    iupdate(ip);  // index blocks are written by iflush
+}
+
+// get the cached index block k, read it if not cached
+// if not exists and alloc is set, alloc it
+// return NULL if not exists
+// readers sharing the inode fill the cache under mlock
+static uint *iblk(struct inode *ip, int k, int alloc) {
+    acquire(&ip->mlock);
+    if (!ip->imap) ip->imap = calloc(1, sizeof(struct imap));
+    struct imap *im = ip->imap;
+    if (im->blk[k]) goto out;
+    uint *pa = iaddr(ip, k, alloc);
+    if (!pa) goto out;
+    if (!BNO(*pa)) {
+        uint b;
+        if (!alloc || !(b = balloc())) goto out;
+        *pa |= b;  // the count of a slot stays
+        if (k >= 2) idirty(ip, 1);
+        iupdate(ip);
+        im->blk[k] = calloc(APB, sizeof(uint));  // balloc zeroed it
+    } else {
+        uint *blk = malloc(BSIZE);
+        bread(BNO(*pa), (uchar *)blk);
+        im->blk[k] = blk;
+    }
+out:
+    release(&ip->mlock);
+    return im->blk[k];
+}
+
+// read the index blocks of an inode not cached yet, all at once
+// for walks over the whole map
+static void iblkall(struct inode *ip) {
+    uint *top = iblk(ip, 1, 0);
+    if (!top) return;
+    int bnos[APB], ks[APB], n = 0;
+    acquire(&ip->mlock);
+    for (int k = 2; k < NINDEX; k++)
+        if (BNO(top[k - 2]) && !ip->imap->blk[k]) {
+            ks[n] = k;
+            bnos[n++] = BNO(top[k - 2]);
+        }
+    release(&ip->mlock);
+    if (n == 0) return;
+    uchar *bufs = malloc(n * BSIZE);
+    bfetch(n, bnos, bufs);
+    acquire(&ip->mlock);
+    for (int i = 0; i < n; i++)
+        if (!ip->imap->blk[ks[i]]) {  // not read by another reader meanwhile
+            ip->imap->blk[ks[i]] = malloc(BSIZE);
+            memcpy(ip->imap->blk[ks[i]], bufs + i * BSIZE, BSIZE);
+        }
+    release(&ip->mlock);
+    free(bufs);
+}
+
+// free index block k and forget it
+static void idrop(struct inode *ip, int k, struct bfreelist *fl) {
+    uint *pa = iaddr(ip, k, 0);
+    bfree_add(fl, BNO(*pa));
+    *pa = 0;
+    if (k >= 2) idirty(ip, 1);
+    free(ip->imap->blk[k]);
+    ip->imap->blk[k] = NULL;
+    ip->imap->dirty[k] = 0;
+}
+
+// forget the cached counts of parts [p, NPART) of the block map, and
+// where the slots start
+static inline void mstale(struct inode *ip, int p) {
+    if (!ip->imap) return;
+    ip->imap->firstok = 0;
+    memset(ip->imap->fillok + p, 0, NPART - p);
+}
+
+// the first block under each slot of the double indirect block, counted
+// from the end of the single indirect block; NULL if there is no double
+// indirect block, then every slot holds APB
+static uint *mfirst(struct inode *ip) {
+    uint *top = iblk(ip, 1, 0);
+    if (!top) return NULL;
+    acquire(&ip->mlock);
+    struct imap *im = ip->imap;
+    if (!im->firstok) {
+        for (int i = 0; i < APB; i++)
+            im->first[i + 1] = im->first[i] + ICNT(top[i]);
+        im->firstok = 1;
+    }
+    release(&ip->mlock);
+    return im->first;
+}
+
+// find the block r past the single indirect block
+// return its slot in the double indirect block, APB if past all of them,
+// and set *s to its entry in the index block of the slot
+static uint mlocate(struct inode *ip, uint r, uint *s) {
+    uint *first = mfirst(ip), lo = 0, hi = APB;
+    if (!first) {
+        *s = r % APB;
+        return min(r / APB, APB);
+    }
+    if (r >= first[APB]) {
+        *s = r - first[APB];
+        return APB;
+    }
+    while (hi - lo > 1) {  // first[lo] <= r < first[hi]
+        uint mid = (lo + hi) / 2;
+        if (first[mid] <= r)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    *s = r - first[lo];
+    return lo;
+}
+
+// the number of blocks the map holds without packing it
+static uint mcap(struct inode *ip) {
+    uint *first = mfirst(ip);
+    return NDIRECT + APB + (first ? first[APB] : APB * APB);
+}
+
+// free data blocks [from, ip->blocks) of an inode into fl
+// index blocks that become empty are freed too
+void ifree(struct inode *ip, uint from, struct bfreelist *fl) {
+    uint *a;
     int apb = APB;
+    ip->tailb = 0;
 
-    for (int i = 0; i < NDIRECT; i++)
+    for (int i = from; i < NDIRECT; i++)
         if (ip->addrs[i]) {
-            bfree(ip->addrs[i]);
+            bfree_add(fl, BNO(ip->addrs[i]));
             ip->addrs[i] = 0;
         }
+    from = from > NDIRECT ? from - NDIRECT : 0;
 
-    if (ip->addrs[NDIRECT]) {
-        bread(ip->addrs[NDIRECT], buf);
-        uint *addrs = (uint *)buf;
-        for (int i = 0; i < apb; i++)
-            if (addrs[i]) bfree(addrs[i]);
-        bfree(ip->addrs[NDIRECT]);
-        ip->addrs[NDIRECT] = 0;
-    }
-
-    if (ip->addrs[NDIRECT + 1]) {
-        bread(ip->addrs[NDIRECT + 1], buf);
-        uint *addrs = (uint *)buf;
-        uchar buf2[BSIZE];
-        for (int i = 0; i < apb; i++) {
-            if (addrs[i]) {
-                bread(addrs[i], buf2);
-                uint *addrs2 = (uint *)buf2;
-                for (int j = 0; j < apb; j++)
-                    if (addrs2[j]) bfree(addrs2[j]);
-                bfree(addrs[i]);
+    if (from < apb && (a = iblk(ip, 0, 0))) {
+        for (int i = from; i < apb; i++)
+            if (a[i]) {
+                bfree_add(fl, BNO(a[i]));
+                a[i] = 0;
             }
+        if (from == 0)
+            idrop(ip, 0, fl);
+        else
+            idirty(ip, 0);
+    }
+    int part = from >= apb;  // the first part changed
+    from = from > apb ? from - apb : 0;
+
+    iblkall(ip);
+    uint *top = iblk(ip, 1, 0);
+    if (top) {
+        uint s, first = mlocate(ip, from, &s);
+        part += first;
+        for (uint i = first; i < APB; i++) {
+            uint start = i == first ? s : 0;
+            if ((a = iblk(ip, 2 + i, 0))) {
+                for (int j = start; j < apb; j++)
+                    if (a[j]) {
+                        bfree_add(fl, BNO(a[j]));
+                        a[j] = 0;
+                    }
+                if (start == 0)
+                    idrop(ip, 2 + i, fl);
+                else
+                    idirty(ip, 2 + i);
+            }
+            top[i] = start ? BNO(top[i]) : 0;  // past the end, full again
         }
-        bfree(ip->addrs[NDIRECT + 1]);
-        ip->addrs[NDIRECT + 1] = 0;
+        idirty(ip, 1);
+        if (from == 0) idrop(ip, 1, fl);
     }
+    mstale(ip, part);
+    iupdate(ip);
+}
 
+// free all data blocks of an inode, but not the inode itself
+void itrunc(struct inode *ip) {
+    struct bfreelist fl = {0};
+    ifree(ip, 0, &fl);
+    bfree_flush(&fl);
     ip->size = 0;
     ip->blocks = 0;
     iupdate(ip);
 }
 
-// if not exists, alloc a block for ip->addrs bn
-// return the block number
-// will not update the inode, update it yourself when freeing
-// you'd better use this continuously
-// will not increase ip->blocks, writei will do that
-int bmap(struct inode *ip, uint bn) {
+// free an inode and all its data blocks
+// the inode should not be used after iput
+void idel(struct inode *ip) {
+    itrunc(ip);
+    ip->type = 0;
+    ip->mode = ip->uid = ip->nlink = 0;
+    iupdate(ip);
+}
+
+// the entry of data block bn
+// index blocks on the way are alloced if alloc is set
+// return NULL if not exists
+static uint *ment(struct inode *ip, uint bn, int alloc) {
+    uint k, s;  // index block holding the entry, and the entry in it
+    if (bn < NDIRECT) return &ip->addrs[bn];
+    if (bn < NDIRECT + APB) {
+        k = 0;
+        s = bn - NDIRECT;
+    } else if ((k = 2 + mlocate(ip, bn - NDIRECT - APB, &s)) >= NINDEX) {
+        if (alloc) Warn("ment: bn too large");
+        return NULL;
+    }
+    uint *a = iblk(ip, k, alloc);
+    return a ? &a[s] : NULL;
+}
+
+// the entry of data block bn, 0 if not exists
+static inline uint mget(struct inode *ip, uint bn) {
+    uint *pe = ment(ip, bn, 0);
+    return pe ? *pe : 0;
+}
+
+// set the entry of data block bn
+// return 0 for success, -1 if no index block can be alloced
+static int mset(struct inode *ip, uint bn, uint e) {
+    uint *pe = ment(ip, bn, 1), s;
+    if (!pe) return -1;
+    *pe = e;
+    int p = bn < NDIRECT + APB ? 0 : 1 + mlocate(ip, bn - NDIRECT - APB, &s);
+    if (bn < NDIRECT)
+        iupdate(ip);
+    else
+        idirty(ip, p ? 1 + p : 0);
+    if (ip->imap) ip->imap->fillok[p] = 0;
+    return 0;
+}
+
+// before data block bn is written in place, give the file its own block
+// if it is shared or pinned; the caller writes the whole block, so
+// nothing is copied
+// return the block to write, 0 if no free block
+static uint bcow(struct inode *ip, uint bn, uint e) {
+    uint b = BNO(e), nb;
+    tabload();  // so nothing is read under the lock
+    acquire(&alloclock);  // the other users may unshare it too
+    int shared = bref(b);
+    if (!shared && !bpinned(b)) {
+        release(&alloclock);
+        return b;
+    }
+    if (ballocn(b + 1, 1, &nb) < 1) {
+        release(&alloclock);
+        return 0;
+    }
+    int unpinned = 0;  // meanwhile, then it is freed now
+    if (shared)
+        brefadd(b, -1);
+    else
+        unpinned = !bretire(b);
+    release(&alloclock);
+    if (unpinned) {
+        struct bfreelist fl = {0};
+        bfree_add(&fl, b);
+        bfree_flush(&fl);
+    }
+    mset(ip, bn, BENT(nb, BFILL(e)));
+    if (ip->tailb == b) ip->tailb = nb;  // same content
+    return nb;
+}
+
+// bytes in the n blocks of part p of the map, which start at block bn
+// cached until an entry of the part changes
+static uint mfill(struct inode *ip, int p, uint bn, uint n) {
+    acquire(&ip->mlock);  // taken again by mget
+    if (!ip->imap) ip->imap = calloc(1, sizeof(struct imap));
+    struct imap *im = ip->imap;
+    if (!im->fillok[p]) {
+        uint f = 0;
+        for (uint i = bn; i < bn + n; i++) f += BFILL(mget(ip, i));
+        im->fill[p] = f;
+        im->fillok[p] = 1;
+    }
+    uint f = im->fill[p];
+    release(&ip->mlock);
+    return f;
+}
+
+// walk the map to the data block holding byte off, but not past block nb
+// whole parts are skipped by their byte counts, so only the blocks of
+// one part are looked at
+// return the block and set *start to the offset it starts at
+static uint mwalk(struct inode *ip, uint off, uint nb, uint *start) {
+    if (ip->blocks > NDIRECT + APB) iblkall(ip);
+    uint *first = mfirst(ip), bn = 0, pos = 0;
+    for (int p = 0; p < NPART; p++) {
+        uint n = p == 0 ? NDIRECT + APB : first ? first[p] - first[p - 1] : APB;
+        if (bn + n > nb) break;
+        uint f = mfill(ip, p, bn, n);
+        if (pos + f > off) break;
+        pos += f;
+        bn += n;
+    }
+    for (; bn < nb; bn++) {
+        uint f = BFILL(mget(ip, bn));
+        if (pos + f > off) break;
+        pos += f;
+    }
+    *start = pos;
+    return bn;
+}
+
+// find the data block holding byte off
+// return its index and set *boff to the offset in it
+// return ip->blocks if off is beyond all blocks
+static uint bfind(struct inode *ip, uint off, uint *boff) {
+    uint start, bn = mwalk(ip, off, ip->blocks, &start);
+    *boff = off - start;
+    return bn;
+}
+
+// the offset data block bn starts at, the capacity for ip->blocks
+static uint moff(struct inode *ip, uint bn) {
+    uint start;
+    mwalk(ip, ~0u, bn, &start);
+    return start;
+}
+
+// move double indirect slot j to t, with its cached block
+// the caller sets slot j again
+static void mmove(struct inode *ip, uint *top, int j, int t) {
+    struct imap *im = ip->imap;
+    top[t] = top[j];
+    im->blk[2 + t] = im->blk[2 + j];
+    im->dirty[2 + t] = im->dirty[2 + j];
+    im->fill[1 + t] = im->fill[1 + j];
+    im->fillok[1 + t] = im->fillok[1 + j];
+}
+
+// set double indirect slot j to n entries in index block b, with
+// content a if b is not 0; the old block of the slot is not freed
+static void mput(struct inode *ip, uint *top, int j, uint b, uint n, uint *a) {
+    struct imap *im = ip->imap;
+    top[j] = IENT(b, n);
+    im->blk[2 + j] = NULL;
+    im->dirty[2 + j] = 0;
+    im->fillok[1 + j] = 0;
+    if (!b) return;
+    im->blk[2 + j] = calloc(APB, sizeof(uint));
+    memcpy(im->blk[2 + j], a, n * sizeof(uint));
+    idirty(ip, 2 + j);
+}
+
+static int mzero(uint *a, uint n) {
+    for (uint i = 0; i < n; i++)
+        if (a[i]) return 0;
+    return 1;
+}
+
+// pack the blocks past the single indirect block into full index blocks,
+// when uneven ones leave no room; the whole map is rewritten
+// return 0 for success, -1 if no free block
+static int mpack(struct inode *ip) {
+    uint *top = iblk(ip, 1, 0);
+    if (!top) return 0;  // all full
+    uint f = NDIRECT + APB, nrel = ip->blocks > f ? ip->blocks - f : 0;
+    uint *e = calloc(APB * APB, sizeof(uint));
+    for (uint r = 0; r < nrel; r++) e[r] = mget(ip, f + r);
+    uint have[APB], nhave = 0, nchunk = (nrel + APB - 1) / APB, need = 0;
+    for (int i = 0; i < APB; i++)
+        if (BNO(top[i])) have[nhave++] = BNO(top[i]);
+    for (uint c = 0; c < nchunk; c++) need += !mzero(e + c * APB, APB);
+    for (uint old = nhave; nhave < need; nhave++)
+        if (!(have[nhave] = balloc())) {
+            struct bfreelist fl = {0};
+            while (nhave-- > old) bfree_add(&fl, have[nhave]);
+            bfree_flush(&fl);
+            free(e);
+            return -1;
+        }
+    struct bfreelist fl = {0};
+    uint h = 0;
+    for (int i = 0; i < APB; i++) free(ip->imap->blk[2 + i]);
+    for (uint c = 0; c < APB; c++) {
+        uint b = c < nchunk && !mzero(e + c * APB, APB) ? have[h++] : 0;
+        mput(ip, top, c, b, APB, e + c * APB);
+    }
+    while (h < nhave) bfree_add(&fl, have[h++]);
+    bfree_flush(&fl);
+    idirty(ip, 1);
+    mstale(ip, 1);
+    free(e);
+    return 0;
+}
+
+// insert n entries at block r past the single indirect block, from e,
+// or holes if e is NULL
+// only the index block at r is rewritten; it is split into new slots
+// after it if it overflows, and the map is packed if none are left
+// return 0 for success, -1 if too large or no free block
+static int dins(struct inode *ip, uint r, uint n, uint *e) {
+    uint *top = iblk(ip, 1, 1);
+    if (!top) return -1;
+    uint nrel = ip->blocks - NDIRECT - APB, s, last;
+    uint used = nrel ? mlocate(ip, nrel - 1, &last) + 1 : 0;  // slots
+    uint i = mlocate(ip, r, &s);
+    // entries of slot i before the end, the rest are holes to drop
+    uint live = i < used ? min(ICNT(top[i]), nrel - (r - s)) : 0;
+    uint items = live + n, extra = (items + APB - 1) / APB - 1;
+    if (i >= APB || max(used, i + 1) + extra > APB) {
+        if (mpack(ip) < 0) return -1;
+        used = nrel ? (nrel - 1) / APB + 1 : 0;
+        i = r / APB;
+        s = r % APB;
+        live = i < used ? min(APB, nrel - (r - s)) : 0;
+        items = live + n;
+        extra = (items + APB - 1) / APB - 1;
+        if (i >= APB || max(used, i + 1) + extra > APB) return -1;
+    }
+
+    uint *a = i < used ? iblk(ip, 2 + i, 0) : NULL;
+    uint *t = calloc(items, sizeof(uint));
+    for (uint j = 0; a && j < live; j++) t[j < s ? j : j + n] = a[j];
+    if (e) memcpy(t + s, e, n * sizeof(uint));
+    // alloc the index blocks first, so the map is never half moved
+    uint b[APB];
+    for (uint c = 0; c <= extra; c++) {
+        uint m = min(APB, items - c * APB);
+        b[c] = c == 0 && i < used ? BNO(top[i]) : 0;
+        if (!b[c] && !mzero(t + c * APB, m) && !(b[c] = balloc())) {
+            struct bfreelist fl = {0};
+            while (c-- > (i < used && BNO(top[i]) ? 1 : 0))
+                if (b[c]) bfree_add(&fl, b[c]);
+            bfree_flush(&fl);
+            free(t);
+            return -1;
+        }
+    }
+
+    struct bfreelist fl = {0};
+    for (uint j = i < used ? used : i; j < APB; j++) {  // past the end
+        if (BNO(top[j])) bfree_add(&fl, BNO(top[j]));
+        free(ip->imap->blk[2 + j]);
+        mput(ip, top, j, 0, APB, NULL);
+    }
+    for (uint j = used; j-- > i + 1;) mmove(ip, top, j, j + extra);
+    if (i < used) free(ip->imap->blk[2 + i]);
+    for (uint c = 0; c <= extra; c++)
+        mput(ip, top, i + c, b[c], min(APB, items - c * APB), t + c * APB);
+    bfree_flush(&fl);
+    idirty(ip, 1);
+    mstale(ip, NPART);
+    free(t);
+    return 0;
+}
+
+// delete n entries at block r past the single indirect block, whose data
+// blocks the caller has freed
+// only the index blocks holding them are rewritten, and the emptied
+// ones are dropped
+static void ddel(struct inode *ip, uint r, uint n) {
+    uint *top = iblk(ip, 1, 0), s;
+    if (!top) return;  // all holes, nothing moves
+    struct bfreelist fl = {0};
+    uint i = mlocate(ip, r, &s);
+    while (n > 0 && i < APB) {
+        uint cnt = ICNT(top[i]), t = min(n, cnt - s);
+        uint *a = iblk(ip, 2 + i, 0);
+        if (a) {
+            memmove(a + s, a + s + t, (cnt - s - t) * sizeof(uint));
+            memset(a + cnt - t, 0, t * sizeof(uint));
+            idirty(ip, 2 + i);
+        }
+        ip->imap->fillok[1 + i] = 0;
+        n -= t;
+        if (t == cnt) {  // emptied, the later slots move down
+            if (BNO(top[i])) bfree_add(&fl, BNO(top[i]));
+            free(a);
+            for (int j = i; j + 1 < APB; j++) mmove(ip, top, j + 1, j);
+            mput(ip, top, APB - 1, 0, APB, NULL);
+        } else {
+            top[i] = IENT(BNO(top[i]), cnt - t);
+            i++;
+        }
+        s = 0;
+    }
+    bfree_flush(&fl);
+    idirty(ip, 1);
+    mstale(ip, NPART);
+}
+
+// move the entries of data blocks [bn, ip->blocks) by d places, before
+// ip->blocks is changed; the caller sets the entries made room for, and
+// the ones left behind are cleared
+// past the single indirect block, only the index blocks at the edit are
+// rewritten, so it costs O(APB + |d|), not O(blocks)
+// return 0 for success, -1 if too large or no free block
+static int mshift(struct inode *ip, uint bn, int d) {
+    uint f = NDIRECT + APB;
+    if (ip->blocks <= f) {  // nothing past the single indirect block
+        if (d > 0) {
+            // alloc index blocks first, so the map is never half moved
+            for (uint i = ip->blocks; i < ip->blocks + d; i++)
+                if (!ment(ip, i, 1)) return -1;
+            for (uint i = ip->blocks; i-- > bn;) mset(ip, i + d, mget(ip, i));
+        } else {
+            for (uint i = bn; i < ip->blocks; i++) mset(ip, i + d, mget(ip, i));
+            for (uint i = ip->blocks + d; i < ip->blocks; i++) mset(ip, i, 0);
+        }
+        return 0;
+    }
+    if (!ment(ip, f - 1, 1)) return -1;  // the single indirect block
+    if (d > 0 && bn >= f) return dins(ip, bn - f, d, NULL);
+    if (d > 0) {
+        // the last d entries before f spill over past it
+        uint *e = malloc(d * sizeof(uint));
+        for (uint j = 0, t = f - bn; j < (uint)d; j++, t++)
+            e[j] = t < (uint)d ? 0 : mget(ip, bn + t - d);
+        int ret = dins(ip, 0, d, e);
+        free(e);
+        if (ret < 0) return -1;
+        for (uint i = f; i-- > bn + d;) mset(ip, i, mget(ip, i - d));
+        return 0;
+    }
+    uint n = -d, s = bn - n;  // entries [s, bn) go
+    if (s >= f) {
+        ddel(ip, s - f, n);
+        return 0;
+    }
+    for (uint i = s; i < f; i++) mset(ip, i, mget(ip, i + n));
+    ddel(ip, 0, n);
+    return 0;
+}
+
+// make the data blocks hold at least len bytes
+// new blocks are holes, writei allocs the ones it writes
+// if fillup is set, the last block is filled up first
+// return 0 for success, -1 if too large
+static int bgrow(struct inode *ip, uint len, int fillup) {
+    uint cap = moff(ip, ip->blocks);
+    if (cap >= len) return 0;
+    if (len > MAXFILEB * BSIZE) return -1;
+    if (fillup && ip->blocks > 0) {
+        uint e = mget(ip, ip->blocks - 1);
+        if (BFILL(e) < BSIZE) {
+            cap += BSIZE - BFILL(e);
+            mset(ip, ip->blocks - 1, BNO(e));
+        }
+    }
+    if (cap >= len) return 0;
+    uint n = (len - cap + BSIZE - 1) / BSIZE;
+    if (ip->blocks + n > MAXFILEB) return -1;
+    if (ip->blocks + n > mcap(ip) && mpack(ip) < 0) return -1;
+    ip->blocks += n;  // entries past blocks are 0
+    iupdate(ip);
+    return 0;
+}
+
+// cut the data blocks at size, so no old data is left after it
+static void bcut(struct inode *ip) {
+    struct bfreelist fl = {0};
+    uint boff, bn = 0;
+    if (ip->size > 0) {
+        bn = bfind(ip, ip->size - 1, &boff) + 1;
+        uint e = mget(ip, bn - 1);
+        if (boff + 1 < BFILL(e)) mset(ip, bn - 1, BENT(BNO(e), boff + 1));
+    }
+    ifree(ip, bn, &fl);
+    bfree_flush(&fl);
+    ip->blocks = bn;
+    iupdate(ip);
+}
+
+// set the size of an inode
+// growing leaves a hole, which takes no blocks
+// return 0 for success, -1 if too large
+int isize(struct inode *ip, uint size) {
+    if (size > ip->size) {
+        bcut(ip);
+        if (bgrow(ip, size, 0) < 0) return -1;
+    }
+    ip->size = size;
+    iupdate(ip);
+    return 0;
+}
+
+// map bytes [off, off + n) of the inode to the entries of their blocks
+// set *nb to the number of blocks and *boff to the offset of off in the
+// first one; return the entries, free it after use
+uint *bmap_range(struct inode *ip, uint off, uint n, uint *nb, uint *boff) {
+    uint first = bfind(ip, off, boff), lastoff;
+    *nb = n ? bfind(ip, off + n - 1, &lastoff) - first + 1 : 0;
+    uint *e = malloc((*nb + 1) * sizeof(uint));
+    for (uint i = 0; i < *nb; i++) e[i] = mget(ip, first + i);
+    return e;
+}
+
+// read n bytes from the data blocks with entries e into dst, starting
+// at boff in the first of the nb blocks
+static void breadents(uint *e, uint nb, uint boff, uchar *dst, uint n) {
+    // all blocks are fetched first, holes are not read
+    int *bnos = malloc(nb * sizeof(int)), nr = 0;
+    for (uint k = 0; k < nb; k++)
+        if (BNO(e[k])) bnos[nr++] = BNO(e[k]);
+    uchar *bufs = malloc(nr * BSIZE), *buf = bufs;
+    bfetch(nr, bnos, bufs);
+    for (uint tot = 0, m, k = 0; tot < n; tot += m, dst += m, k++, boff = 0) {
+        m = min(n - tot, BFILL(e[k]) - boff);
+        if (BNO(e[k])) {
+            memcpy(dst, buf + boff, m);
+            buf += BSIZE;
+        } else {
+            memset(dst, 0, m);  // a hole
+        }
+    }
+    free(bufs);
+    free(bnos);
+}
+
+// read from the inode
+// return the number of bytes read
+int readi(struct inode *ip, uchar *dst, uint off, uint n) {
+    if (off > ip->size || off + n < off) return -1;
+    if (off + n > ip->size)  // read till EOF
+        n = ip->size - off;
+
+    uint nb, boff;
+    uint *e = bmap_range(ip, off, n, &nb, &boff);
+    breadents(e, nb, boff, dst, n);
+    free(e);
+    return n;
+}
+
+// publish the current state of ip as its snap, if it changed or has none
+// the caller holds ip locked, readers racing to make one keep the first
+static void snappub(struct inode *ip) {
+    struct snap *s = calloc(1, sizeof(struct snap));
+    s->ref = 1;
+    s->type = ip->type;
+    s->mode = ip->mode;
+    s->uid = ip->uid;
+    s->mtime = ip->mtime;
+    s->size = ip->size;
+    acquire(&ip->mlock);
+    struct snap *old = ip->snap;
+    if (old && !ip->changed) {
+        old = s;  // made meanwhile
+    } else {
+        ip->snap = s;
+        ip->changed = 0;
+    }
+    release(&ip->mlock);
+    if (old) snapput(ip, old);
+}
+
+// fill the entries of s, the current snap of ip, and pin their blocks
+// the caller holds ip locked for reading, so no writer moves them
+static void snapfill(struct inode *ip, struct snap *s) {
+    acquire(&ip->mlock);
+    int done = s->e != NULL;
+    release(&ip->mlock);
+    if (done) return;
+    uint boff, nb = s->size ? bfind(ip, s->size - 1, &boff) + 1 : 0;
+    uint *e = malloc((nb + 1) * sizeof(uint));
+    uint *start = malloc((nb + 1) * sizeof(uint));
+    start[0] = 0;
+    for (uint bn = 0; bn < nb; bn++) {
+        e[bn] = mget(ip, bn);
+        start[bn + 1] = start[bn] + BFILL(e[bn]);
+    }
+    bpinall(e, nb);
+    acquire(&ip->mlock);
+    if (!s->e) {  // else another reader filled it meanwhile
+        s->start = start;
+        s->nb = nb;
+        s->e = e;
+        e = NULL;
+    }
+    release(&ip->mlock);
+    if (e) {
+        bunpinall(e, nb);
+        free(e);
+        free(start);
+    }
+}
+
+static void snapfree(struct snap *s) {
+    if (s->e) bunpinall(s->e, s->nb);
+    free(s->e);
+    free(s->start);
+    free(s);
+}
+
+// get the current snap of ip, with the entries of its data blocks if
+// data is set; it stays as it is while held, even if ip changes
+// the inode lock is only taken to fill it, as a writer makes one first
+// remember to snapput it!
+struct snap *snapget(struct inode *ip, int data) {
+    acquire(&ip->mlock);
+    struct snap *s = ip->snap;
+    if (s && (s->e || !data)) {
+        s->ref++;
+        release(&ip->mlock);
+        return s;
+    }
+    release(&ip->mlock);
+    ilockr(ip);  // no writer in the middle of a change now
+    if (!ip->snap) snappub(ip);
+    acquire(&ip->mlock);
+    s = ip->snap;
+    s->ref++;  // before it is filled, so no snapput empties it meanwhile
+    release(&ip->mlock);
+    if (data) snapfill(ip, s);
+    iunlock(ip);
+    return s;
+}
+
+// release a snap of ip, the last user frees it and unpins its blocks
+// the last reader of the current one drops its entries and unpins the
+// blocks, so writers do not copy blocks no one reads; the next reader
+// fills it again
+void snapput(struct inode *ip, struct snap *s) {
+    uint *e = NULL, *start = NULL, nb = 0;
+    acquire(&ip->mlock);
+    int last = --s->ref == 0;
+    if (s->ref == 1 && s == ip->snap && s->e) {
+        e = s->e;
+        start = s->start;
+        nb = s->nb;
+        s->e = s->start = NULL;
+        s->nb = 0;
+    }
+    release(&ip->mlock);
+    if (last) snapfree(s);
+    if (e) {
+        bunpinall(e, nb);
+        free(e);
+        free(start);
+    }
+}
+
+// find the data block of a filled snap holding byte off, like bfind
+static uint snapfind(struct snap *s, uint off, uint *boff) {
+    uint lo = 0, hi = s->nb;
+    if (off >= s->start[hi]) {
+        *boff = off - s->start[hi];
+        return hi;
+    }
+    while (hi - lo > 1) {  // start[lo] <= off < start[hi]
+        uint mid = (lo + hi) / 2;
+        if (s->start[mid] <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    *boff = off - s->start[lo];
+    return lo;
+}
+
+// read from a filled snap like readi
+// return the number of bytes read
+static int snapread(struct snap *s, uchar *dst, uint off, uint n) {
+    if (off > s->size || off + n < off) return -1;
+    if (off + n > s->size) n = s->size - off;
+    if (n == 0) return 0;
+    uint boff, lastoff, bn = snapfind(s, off, &boff);
+    uint nb = snapfind(s, off + n - 1, &lastoff) - bn + 1;
+    breadents(s->e + bn, nb, boff, dst, n);
+    return n;
+}
+
+// write to the inode
+// return the number of bytes written
+// may change the size
+// will update
+int writei(struct inode *ip, uchar *src, uint off, uint n) {
     uchar buf[BSIZE];
-    uint addr;
-    if (bn < NDIRECT) {
-        addr = ip->addrs[bn];
-        if (!addr) addr = ip->addrs[bn] = balloc();
-        return addr;
-    } else if (bn < NDIRECT + APB) {
-        bn -= NDIRECT;
-        uint saddr = ip->addrs[NDIRECT];  // single addr
-        if (!saddr) saddr = ip->addrs[NDIRECT] = balloc();
-        bread(saddr, buf);
-        uint *addrs = (uint *)buf;
-        addr = addrs[bn];
-        if (!addr) {
-            addr = addrs[bn] = balloc();
-            bwrite(saddr, buf);
+    if (off + n < off) return -1;  // off overflow
+    if (off > ip->size && isize(ip, off) < 0) return -1;  // leave a hole
+    if (bgrow(ip, off + n, 1) < 0) return -1;              // too large
+
+    uint nb, boff, end = off + n;
+    uint *e = bmap_range(ip, off, n, &nb, &boff);
+    uint bn = bfind(ip, off, &boff);
+
+    // holes to be written get blocks together, after the block before
+    uint nh = 0, goal = bn > 0 ? BNO(mget(ip, bn - 1)) : 0;
+    int ok = 1;
+    for (uint k = 0; k < nb; k++)
+        if (BNO(e[k])) {
+            if (nh == 0) goal = BNO(e[k]);
+        } else {
+            nh++;
+            if (!ment(ip, bn + k, 1)) ok = 0;  // no index block
+        }
+    uint *hb = malloc((nh + 1) * sizeof(uint));
+    int got = ok ? ballocn(goal ? goal + 1 : 0, nh, hb) : 0;
+    if (got < (int)nh) {
+        struct bfreelist fl = {0};
+        for (int j = 0; j < got; j++) bfree_add(&fl, hb[j]);
+        bfree_flush(&fl);
+        free(hb);
+        free(e);
+        return -1;
+    }
+
+    uint tot = 0, j = 0;
+    for (uint m, k = 0; tot < n; tot += m, off += m, src += m, k++, boff = 0) {
+        uint b = BNO(e[k]);
+        m = min(n - tot, BFILL(e[k]) - boff);
+        // keep the rest of the block if it is in use
+        int keep =
+            boff > 0 || (m < BFILL(e[k]) - boff && off + m < ip->size);
+        if (!b) {
+            b = hb[j++];
+            mset(ip, bn + k, BENT(b, BFILL(e[k])));
+            if (keep) memset(buf, 0, BSIZE);  // it was a hole
+        } else {
+            if (keep) {
+                if (b == ip->tailb)
+                    memcpy(buf, ip->tail, BSIZE);
+                else
+                    bread(b, buf);
+            }
+            if (!(b = bcow(ip, bn + k, e[k]))) break;  // no free block
         }
-        return addr;
-    } else if (bn < MAXFILEB) {
-        bn -= NDIRECT + APB;
-        uint a = bn / APB, b = bn % APB;
-        uint daddr = ip->addrs[NDIRECT + 1];  // double addr
-        if (!daddr) daddr = ip->addrs[NDIRECT + 1] = balloc();
-        bread(daddr, buf);
-        uint *addrs = (uint *)buf;
-
-        uint saddr = addrs[a];  // single addr
-        if (!saddr) {
-            saddr = addrs[a] = balloc();
-            bwrite(daddr, buf);
+        memcpy(buf + boff, src, m);
+        bwrite(b, buf);
+        // remember the block at EOF, so appends need not read it back
+        if (b == ip->tailb || (off + m == end && end >= ip->size)) {
+            if (!ip->tail) ip->tail = malloc(BSIZE);
+            memcpy(ip->tail, buf, BSIZE);
+            ip->tailb = b;
         }
-        bread(saddr, buf);
-        addrs = (uint *)buf;
+    }
+    if (tot < n) {
+        struct bfreelist fl = {0};
+        while (j < nh) bfree_add(&fl, hb[j++]);
+        bfree_flush(&fl);
+    }
+    free(hb);
+    free(e);
+
+    if (off > ip->size) ip->size = off;  // size is larger
+    iupdate(ip);
+    return tot < n ? -1 : n;
+}
 
-        addr = addrs[b];
-        if (!addr) {
-            addr = addrs[b] = balloc();
-            bwrite(saddr, buf);
+// insert n bytes of src at off, which must be inside the file
+// only the block holding off is rewritten; if it overflows, new blocks
+// are spliced into the map after it
+// return n, -1 if too large or no free block
+int splicei(struct inode *ip, uchar *src, uint off, uint n) {
+    uint boff, bn = bfind(ip, off, &boff);
+    uint e = mget(ip, bn);
+    uint fill = min(BFILL(e), ip->size - moff(ip, bn));  // bytes used
+    uint len = fill + n, nb = (len + BSIZE - 1) / BSIZE;
+    if (ip->blocks + nb - 1 > MAXFILEB) return -1;
+    ip->tailb = 0;
+
+    uchar *buf = malloc(nb * BSIZE);
+    uint *bnos = malloc(nb * sizeof(uint));
+    uint first = 0;  // first new block
+    if ((bnos[0] = BNO(e))) {
+        bread(bnos[0], buf);
+        first = 1;
+        if (!(bnos[0] = bcow(ip, bn, e))) {
+            free(buf);
+            free(bnos);
+            return -1;
         }
-        return addr;
     } else {
-        Warn("bmap: bn too large");
-        return 0;
+        memset(buf, 0, BSIZE);  // a hole gets a block now
+    }
+    memmove(buf + boff + n, buf + boff, fill - boff);
+    memcpy(buf + boff, src, n);
+
+    uint goal = bnos[0] ? bnos[0] + 1 : 0;
+    uint i = first + ballocn(goal, nb - first, bnos + first);
+    if (i < nb || mshift(ip, bn + 1, nb - 1) < 0) {
+        struct bfreelist fl = {0};
+        while (i-- > first) bfree_add(&fl, bnos[i]);
+        bfree_flush(&fl);
+        free(buf);
+        free(bnos);
+        return -1;
     }
+    ip->blocks += nb - 1;
+    for (i = 0; i < nb; i++) {
+        bwrite(bnos[i], buf + i * BSIZE);
+        mset(ip, bn + i, BENT(bnos[i], min(BSIZE, len - i * BSIZE)));
+    }
+    ip->size += n;
+    iupdate(ip);
+    free(buf);
+    free(bnos);
+    return n;
 }
 
-// read from the inode
-// return the number of bytes read
-int readi(struct inode *ip, uchar *dst, uint off, uint n) {
-    uchar buf[BSIZE];
-    if (off > ip->size || off + n < off) return -1;
-    if (off + n > ip->size)  // read till EOF
-        n = ip->size - off;
+// delete n bytes at off, some data must follow them
+// only the blocks at both ends are rewritten, the ones between are freed
+// and cut out of the map; the ends are merged if they fit in one block
+// return 0 for success, -1 if no free block to unshare an end
+int spliced(struct inode *ip, uint off, uint n) {
+    uchar buf[BSIZE], buf2[BSIZE];
+    if (n == 0) return 0;
+    ip->tailb = 0;
+    uint o1, k1 = bfind(ip, off, &o1);
+    uint o2, k2 = bfind(ip, off + n, &o2);
+    uint e1 = mget(ip, k1), e2 = mget(ip, k2), b;
+    uint fill2 = min(BFILL(e2), ip->size - moff(ip, k2));
+    uint cut = k1 + (o1 > 0), end = k2;  // blocks [cut, end) are dropped
+
+    // holes are all zeros, only their lengths change
+    if (k1 == k2) {
+        if ((b = BNO(e1))) {
+            bread(b, buf);
+            if (!(b = bcow(ip, k1, e1))) return -1;
+            memmove(buf + o1, buf + o2, fill2 - o2);
+            bwrite(b, buf);
+        }
+        mset(ip, k1, BENT(b, fill2 - n));
+        cut = end;
+    } else if (o1 > 0 && o1 + fill2 - o2 <= BSIZE && BNO(e1) && BNO(e2)) {
+        // merge the rest of k2 into k1
+        bread(BNO(e1), buf);
+        bread(BNO(e2), buf2);
+        if (!(b = bcow(ip, k1, e1))) return -1;
+        memcpy(buf + o1, buf2 + o2, fill2 - o2);
+        bwrite(b, buf);
+        mset(ip, k1, BENT(b, o1 + fill2 - o2));
+        end = k2 + 1;
+    } else {
+        if (o2 > 0) {
+            if ((b = BNO(e2))) {
+                bread(b, buf);
+                if (!(b = bcow(ip, k2, e2))) return -1;
+                memmove(buf, buf + o2, fill2 - o2);
+                bwrite(b, buf);
+            }
+            mset(ip, k2, BENT(b, fill2 - o2));
+        }
+        if (o1 > 0) mset(ip, k1, BENT(BNO(e1), o1));  // just shorter
+    }
 
-    for (uint tot = 0, m; tot < n; tot += m, off += m, dst += m) {
-        bread(bmap(ip, off / BSIZE), buf);
-        m = min(n - tot, BSIZE - off % BSIZE);
-        memcpy(dst, buf + off % BSIZE, m);
+    if (cut < end) {
+        struct bfreelist fl = {0};
+        uint d = end - cut;
+        for (uint i = cut; i < end; i++) bfree_add(&fl, BNO(mget(ip, i)));
+        mshift(ip, end, -(int)d);
+        ip->blocks -= d;
+        ifree(ip, ip->blocks, &fl);  // drop empty index blocks
+        bfree_flush(&fl);
     }
-    return n;
+    ip->size -= n;
+    iupdate(ip);
+    return 0;
 }
 
-// write to the inode
-// return the number of bytes written
-// may change the size
-// will update
-int writei(struct inode *ip, uchar *src, uint off, uint n) {
+// share the data of src with the empty file dst
+// blocks are shared by ref counts, and copied if they can not be
+// return 0 for success, -1 if no free block
+int icopy(struct inode *src, struct inode *dst) {
     uchar buf[BSIZE];
-    if (off > ip->size || off + n < off)
-        return -1;  // off is larger than size || off overflow
-    if (off + n > MAXFILEB * BSIZE) return -1;  // too large
-
-    for (uint tot = 0, m; tot < n; tot += m, off += m, src += m) {
-        bread(bmap(ip, off / BSIZE), buf);
-        m = min(n - tot, BSIZE - off % BSIZE);
-        memcpy(buf + off % BSIZE, src, m);
-        bwrite(bmap(ip, off / BSIZE), buf);
+    uint boff, nb = src->size ? bfind(src, src->size - 1, &boff) + 1 : 0;
+    // alloc index blocks first, so the map can be set without failing
+    for (uint bn = NDIRECT; bn < nb; bn += APB)
+        if (!ment(dst, bn, 1)) return -1;
+    uint *e = malloc((nb + 1) * sizeof(uint));  // entries of src
+    uchar *shared = malloc(nb + 1);             // 0 for blocks to copy
+    for (uint bn = 0; bn < nb; bn++) e[bn] = mget(src, bn);
+
+    // the counts must not change between the check and the share
+    tabload();
+    acquire(&alloclock);
+    int n = 0;  // blocks to copy
+    for (uint bn = 0; bn < nb; bn++) {
+        uint b = BNO(e[bn]);
+        shared[bn] = !b || (sb.refstart && bref(b) < MAXREF);
+        if (!shared[bn]) n++;
+    }
+    uint *nbnos = malloc((n + 1) * sizeof(uint));
+    int got = ballocn(0, n, nbnos);
+    if (got == n)
+        for (uint bn = 0; bn < nb; bn++)
+            if (shared[bn] && BNO(e[bn])) brefadd(BNO(e[bn]), 1);
+    release(&alloclock);
+    if (got < n) {
+        struct bfreelist fl = {0};
+        for (int j = 0; j < got; j++) bfree_add(&fl, nbnos[j]);
+        bfree_flush(&fl);
+        free(nbnos);
+        free(shared);
+        free(e);
+        return -1;
     }
 
-    if (n > 0 && off > ip->size) {  // size is larger
-        ip->size = off;
-        ip->blocks =
-            max(1 + (off - 1) / BSIZE, ip->blocks);  // blocks may change
+    for (uint bn = 0, j = 0; bn < nb; bn++) {
+        uint b = BNO(e[bn]);
+        if (!shared[bn]) {
+            bread(b, buf);
+            bwrite(nbnos[j], buf);
+            b = nbnos[j++];
+        }
+        mset(dst, bn, BENT(b, BFILL(e[bn])));
     }
-    ip->mtime = time(NULL);
-    iupdate(ip);
-    return n;
+    free(nbnos);
+    free(shared);
+    free(e);
+    dst->blocks = nb;
+    dst->size = src->size;
+    iupdate(dst);
+    Log("Copy %d blocks, %d shared", nb, nb - n);
+    return 0;
 }
 
 // test if ip->blocks is too larger than size
 // recycle blocks
 // use after shrink ip->size, such as truct
 int itest(struct inode *ip) {
-    int true_blocks = 1 + (ip->size - 1) / BSIZE;
+    uint boff;
+    uint true_blocks = ip->size ? bfind(ip, ip->size - 1, &boff) + 1 : 0;
     if (true_blocks <= ip->blocks / 2) {
         Log("Block usage: %d/%d, recycle", true_blocks, ip->blocks);
-        for (int i = ip->blocks - 1; i > true_blocks; i--) bfree(bmap(ip, i));
+        struct bfreelist fl = {0};
+        ifree(ip, true_blocks, &fl);
+        bfree_flush(&fl);
         ip->blocks = true_blocks;
         iupdate(ip);
     }
@@ -428,8 +2017,17 @@ int itest(struct inode *ip) {
 // for (int i = 0; i < argc; i++) Debug("argv[%d] = %s", i, argv[i]);
 // if (maxargs != MAXARGS) Debug("argv[argc] = %s", argv[argc]);
 
-// client socket
-int connfd;
+// queue msg as reply to the client, and start a new one
+#define msgflush()                  \
+    do {                            \
+        sendraw(msg, msgtmp - msg); \
+        msginit();                  \
+    } while (0)
+// queue msg now if less than n bytes are left, for long replies
+#define msgroom(n)                                    \
+    do {                                              \
+        if (msgtmp - msg + (n) > MSGSIZE) msgflush(); \
+    } while (0)
 
 enum { R = 0b10, W = 0b01 };
 
@@ -446,7 +2044,7 @@ static inline int checkPerm(uint inum, short perm) {
         else
             ret = 0;
     }
-    free(ip);
+    iput(ip);
     return ret;
 }
 
@@ -458,12 +2056,338 @@ static inline int checkPerm(uint inum, short perm) {
         }                               \
     } while (0)
 
+// directories of at least DXMIN blocks get a hash index, an inode of
+// type T_IDX whose blocks are buckets of (hash, slot) pairs
+// a lookup reads one bucket, then the directory blocks of its slots
+// the index inode is kept in the unused bytes of the "." entry, so
+// small directories stay linear
+#define DXMIN 4
+#define DXMAGIC 0x58444e49  // "INDX"
+
+struct dxroot {    // 16 bytes, overlays the "." entry
+    uint inum;     // The directory itself
+    char name[4];  // "."
+    uint idx;      // Index inode
+    uint magic;    // DXMAGIC if idx is valid
+};
+
+struct dxentry {  // 8 bytes
+    uint hash;    // Hash of the name
+    uint slot;    // Entry number in the directory, 0 for empty
+};
+
+// dxentry per block
+#define XPB (BSIZE / sizeof(struct dxentry))
+
+// FNV-1a hash of a name
+static uint dxhash(char *name) {
+    uint h = 2166136261u;
+    for (int i = 0; i < MAXNAME && name[i]; i++)
+        h = (h ^ (uchar)name[i]) * 16777619u;
+    return h;
+}
+
+// the index inode of a directory, 0 if it is linear
+static uint dxidx(struct inode *dp) {
+    acquire(&dp->mlock);
+    if (!dp->dxread) {
+        struct dxroot root;
+        dp->dxidx = 0;
+        if (readi(dp, (uchar *)&root, 0, sizeof(root)) == sizeof(root) &&
+            root.magic == DXMAGIC && root.idx > 0 && root.idx < NINODES)
+            dp->dxidx = root.idx;
+        dp->dxread = 1;
+    }
+    release(&dp->mlock);
+    return dp->dxidx;
+}
+
+// record the index inode in the "." entry
+static void dxsetroot(struct inode *dp, uint idx) {
+    struct dxroot root;
+    readi(dp, (uchar *)&root, 0, sizeof(root));
+    root.idx = idx;
+    root.magic = idx ? DXMAGIC : 0;
+    writei(dp, (uchar *)&root, 0, sizeof(root));
+    dp->dxidx = idx;
+    dp->dxread = 1;
+}
+
+// free an index inode
+static void dxfree(uint idx) {
+    struct inode *xp = idx ? iget(idx) : NULL;
+    if (!xp) return;
+    ilock(xp);
+    idel(xp);
+    iunlockput(xp);
+}
+
+// get the index inode of a directory locked, and the number of buckets
+// locked alone even by readers of the directory, as each use is short
+// return NULL if the directory is linear
+static struct inode *dxget(struct inode *dp, uint *nbucket) {
+    uint idx = dxidx(dp);
+    struct inode *xp = idx ? iget(idx) : NULL;
+    if (!xp) return NULL;
+    ilock(xp);
+    if (xp->size < BSIZE) {
+        iunlockput(xp);
+        return NULL;
+    }
+    *nbucket = xp->size / BSIZE;
+    return xp;
+}
+
+// (re)build the hash index of a directory from its entries
+// directories smaller than DXMIN blocks are left linear
+void dx_build(struct inode *dp) {
+    if (dp->size < DXMIN * BSIZE) {
+        if (dxidx(dp)) {
+            dxfree(dxidx(dp));
+            dxsetroot(dp, 0);
+        }
+        return;
+    }
+    int nfile = dp->size / sizeof(struct dirent);
+    struct dirent *de = malloc(dp->size);
+    readi(dp, (uchar *)de, 0, dp->size);
+
+    uint nbucket = 1;
+    while (nbucket * XPB < 2 * nfile) nbucket *= 2;
+    struct dxentry *xe;
+    for (int full = 1; full; nbucket *= 2) {  // until every bucket fits
+        xe = calloc(nbucket * XPB, sizeof(struct dxentry));
+        full = 0;
+        for (int i = 1; i < nfile && !full; i++) {  // "." is not indexed
+            if (de[i].inum == NINODES) continue;    // deleted
+            uint h = dxhash(de[i].name);
+            struct dxentry *b = &xe[(h & (nbucket - 1)) * XPB];
+            int j = 0;
+            while (j < XPB && b[j].slot) j++;
+            if (j == XPB)
+                full = 1;
+            else
+                b[j] = (struct dxentry){h, i};
+        }
+        if (!full) break;
+        free(xe);
+    }
+    free(de);
+
+    uint idx = dxidx(dp);
+    struct inode *xp = idx ? iget(idx) : ialloc(T_IDX);
+    if (xp) {
+        ilock(xp);
+        uint size = nbucket * BSIZE;
+        xp->nlink = 1;
+        writei(xp, (uchar *)xe, 0, size);
+        if (xp->size > size) {
+            xp->size = size;
+            itest(xp);
+        }
+        if (!idx) dxsetroot(dp, xp->inum);
+        Log("Directory inode %d indexed, %d entries in %d buckets", dp->inum,
+            nfile, nbucket);
+        iunlockput(xp);
+    }
+    free(xe);
+}
+
+// add entry slot of a directory to its hash index
+// the index is built when the directory grows large enough
+void dx_add(struct inode *dp, char *name, uint slot) {
+    uint nbucket;
+    struct inode *xp = dxget(dp, &nbucket);
+    if (!xp) {
+        if (dp->size >= DXMIN * BSIZE) dx_build(dp);
+        return;
+    }
+    struct dxentry b[XPB];
+    uint h = dxhash(name), off = (h & (nbucket - 1)) * BSIZE;
+    readi(xp, (uchar *)b, off, BSIZE);
+    for (int j = 0; j < XPB; j++)
+        if (!b[j].slot) {
+            b[j] = (struct dxentry){h, slot};
+            writei(xp, (uchar *)b, off, BSIZE);
+            iunlockput(xp);
+            return;
+        }
+    iunlockput(xp);
+    dx_build(dp);  // bucket is full, rebuild with more buckets
+}
+
+// remove entry slot of a directory from its hash index
+void dx_del(struct inode *dp, char *name, uint slot) {
+    uint nbucket;
+    struct inode *xp = dxget(dp, &nbucket);
+    if (!xp) return;
+    struct dxentry b[XPB];
+    uint off = (dxhash(name) & (nbucket - 1)) * BSIZE;
+    readi(xp, (uchar *)b, off, BSIZE);
+    for (int j = 0; j < XPB; j++)
+        if (b[j].slot == slot) {
+            b[j].slot = 0;
+            writei(xp, (uchar *)b, off, BSIZE);
+            break;
+        }
+    iunlockput(xp);
+}
+
+// find entry name in directory dp, without the dentry cache
+// return its slot and copy it to de, -1 for not found
+static int dirfind(struct inode *dp, char *name, struct dirent *de) {
+    uint nbucket;
+    struct inode *xp = dxget(dp, &nbucket);
+    if (xp) {  // read the bucket, then the entries with the same hash
+        struct dxentry b[XPB];
+        uint h = dxhash(name);
+        readi(xp, (uchar *)b, (h & (nbucket - 1)) * BSIZE, BSIZE);
+        iunlockput(xp);
+        for (int j = 0; j < XPB; j++) {
+            if (!b[j].slot || b[j].hash != h) continue;
+            readi(dp, (uchar *)de, b[j].slot * sizeof(*de), sizeof(*de));
+            if (de->inum != NINODES && strcmp(de->name, name) == 0)
+                return b[j].slot;
+        }
+        return -1;
+    }
+
+    uchar *buf = malloc(dp->size);
+    readi(dp, buf, 0, dp->size);
+    struct dirent *des = (struct dirent *)buf;
+
+    int result = -1;
+    int nfile = dp->size / sizeof(struct dirent);
+    for (int i = 0; i < nfile; i++) {
+        if (des[i].inum == NINODES) continue;  // deleted
+        if (strcmp(des[i].name, name) == 0) {
+            *de = des[i];
+            result = i;
+            break;
+        }
+    }
+    free(buf);
+    return result;
+}
+
+static void slot_push(struct freeslots *fl, uint slot) {
+    if (fl->n == fl->cap) {
+        fl->cap = fl->cap ? fl->cap * 2 : 16;
+        fl->slot = realloc(fl->slot, fl->cap * sizeof(uint));
+    }
+    fl->slot[fl->n++] = slot;
+}
+
+// the free slots of a directory, found by scanning it on first use
+static struct freeslots *dirslots(struct inode *dp) {
+    if (dp->fslots) return dp->fslots;
+    struct freeslots *fl = dp->fslots = calloc(1, sizeof(struct freeslots));
+    struct dirent de[DPB];
+    for (uint off = 0; off < dp->size; off += BSIZE) {
+        int n = readi(dp, (uchar *)de, off, BSIZE) / sizeof(struct dirent);
+        for (int i = 0; i < n; i++)
+            if (de[i].inum == NINODES)
+                slot_push(fl, off / sizeof(struct dirent) + i);
+    }
+    return fl;
+}
+
+// cut deleted entries off the end of a directory
+// only reads the blocks being cut and the last block kept
+static void dirtrim(struct inode *dp) {
+    struct dirent de[DPB];
+    uint n = dp->size / sizeof(struct dirent), end = n;
+    while (end > 2) {  // "." and ".." always stay
+        uint first = (end - 1) / DPB * DPB;  // first slot of the last block
+        readi(dp, (uchar *)de, first * sizeof(struct dirent),
+              (end - first) * sizeof(struct dirent));
+        while (end > first && de[end - 1 - first].inum == NINODES) end--;
+        if (end > first) break;
+    }
+    if (end == n) return;
+
+    struct freeslots *fl = dirslots(dp);
+    int j = 0;
+    for (int i = 0; i < fl->n; i++)
+        if (fl->slot[i] < end) fl->slot[j++] = fl->slot[i];
+    fl->n = j;
+    dp->size = end * sizeof(struct dirent);
+    iupdate(dp);
+    itest(dp);  // try to shrink
+}
+
+// dentry cache: (parent inum, name) -> inum, shared by all clients
+// inum is NINODES for names known not to exist
+// direct mapped, a new entry replaces the old one in its slot
+#define NDCACHE 1024
+
+struct dentry {
+    uint pinum;  // Parent directory, NINODES for empty slot
+    uint inum;
+    char name[MAXNAME];
+} dcache[NDCACHE];
+static pthread_mutex_t dcachelock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct dentry *d_slot(uint pinum, char *name) {
+    return &dcache[(dxhash(name) ^ pinum * 2654435761u) % NDCACHE];
+}
+
+// look up the dentry cache
+// return 1 and set *inum if cached
+static int d_lookup(uint pinum, char *name, uint *inum) {
+    struct dentry *d = d_slot(pinum, name);
+    acquire(&dcachelock);
+    int hit = d->pinum == pinum && strncmp(d->name, name, MAXNAME) == 0;
+    if (hit) *inum = d->inum;
+    release(&dcachelock);
+    return hit;
+}
+
+// remember that name in pinum is inum, NINODES for not found
+void d_add(uint pinum, char *name, uint inum) {
+    if (strlen(name) >= MAXNAME) return;
+    struct dentry *d = d_slot(pinum, name);
+    acquire(&dcachelock);
+    d->pinum = pinum;
+    d->inum = inum;
+    strncpy(d->name, name, MAXNAME);
+    release(&dcachelock);
+}
+
+// forget all entries in directory pinum
+void d_purge(uint pinum) {
+    acquire(&dcachelock);
+    for (int i = 0; i < NDCACHE; i++)
+        if (dcache[i].pinum == pinum) dcache[i].pinum = NINODES;
+    release(&dcachelock);
+}
+
+// forget everything, used when the disk is formatted
+void d_clear() {
+    acquire(&dcachelock);
+    for (int i = 0; i < NDCACHE; i++) dcache[i].pinum = NINODES;
+    release(&dcachelock);
+}
+
+// look up name in directory dp, the caller holds it locked
+// NINODES for not found
+uint dirlookup(struct inode *dp, char *name) {
+    if (strcmp(name, ".") == 0) return dp->inum;
+    uint inum;
+    if (d_lookup(dp->inum, name, &inum)) return inum;
+    struct dirent de;
+    inum = dirfind(dp, name, &de) < 0 ? NINODES : de.inum;
+    d_add(dp->inum, name, inum);
+    return inum;
+}
+
 // create a file in parent pinum
-// will not check name
+// will not check name, the caller holds the parent locked
 // return 0 for success
 int icreate(short type, char *name, uint pinum, ushort uid, ushort perm) {
     struct inode *ip = ialloc(type);
     CheckIP(1);
+    ilock(ip);  // iflush may see it already
     ip->mode = perm;
     ip->uid = uid;
     ip->nlink = 1;
@@ -472,6 +2396,7 @@ int icreate(short type, char *name, uint pinum, ushort uid, ushort perm) {
     uint inum = ip->inum;
     if (type == T_DIR) {
         struct dirent des[2];
+        memset(des, 0, sizeof(des));
         des[0].inum = inum;
         strcpy(des[0].name, ".");
         des[1].inum = pinum;
@@ -482,16 +2407,21 @@ int icreate(short type, char *name, uint pinum, ushort uid, ushort perm) {
     Log("Create %s inode %d, inside directory inode %d",
         type == T_DIR ? "dir" : "file", ip->inum, pinum);
     prtinode(ip);
-    free(ip);
+    iunlockput(ip);
     if (pinum != inum) {  // root will not enter here
                           // for normal files, add it to the parent directory
         ip = iget(pinum);
         CheckIP(1);
         struct dirent de;
+        memset(&de, 0, sizeof(de));
         de.inum = inum;
         strcpy(de.name, name);
-        writei(ip, (uchar *)&de, ip->size, sizeof(de));
-        free(ip);
+        struct freeslots *fl = dirslots(ip);
+        uint slot = fl->n ? fl->slot[--fl->n] : ip->size / sizeof(de);
+        writei(ip, (uchar *)&de, slot * sizeof(de), sizeof(de));
+        dx_add(ip, name, slot);
+        d_add(pinum, name, inum);
+        iput(ip);
     }
     return 0;
 }
@@ -504,13 +2434,13 @@ int icreate(short type, char *name, uint pinum, ushort uid, ushort perm) {
 // for example, parse "a b c d e f", 3
 // result: argc=3, argv=["a", "b", "c", "d e f"]
 int parse(char *line, char *argv[], int lim) {
-    char *p;
+    char *p, *save;
     int argc = 0;
-    p = strtok(line, " \r\n");
+    p = strtok_r(line, " \r\n", &save);
     while (p) {
         argv[argc++] = p;
         if (argc >= lim) break;
-        p = strtok(NULL, " \r\n");
+        p = strtok_r(NULL, " \r\n", &save);
     }
     if (argc >= lim) {
         argv[argc] = p + strlen(p) + 1;
@@ -526,11 +2456,15 @@ int cmd_f(char *args) {
     CheckLogin();
     uchar buf[BSIZE];
 
+    rinval();  // uses the old size
+    fmtgen++;
+
     // calculate args and write superblock
     fsize = ncyl * nsec;
     Log("ncyl=%d nsec=%d fsize=%d", ncyl, nsec, fsize);
     nbitmap = (fsize / BPB) + 1;
-    nmeta = 1 + ninodesblocks + nbitmap;
+    nrefs = (fsize / BSIZE) + 1;
+    nmeta = 1 + ninodesblocks + nbitmap + nrefs;
     nblocks = fsize - nmeta;
     Log("ninodeblocks=%d nbitmap=%d nblocks=%d", fsize, nmeta, nblocks);
 
@@ -540,9 +2474,14 @@ int cmd_f(char *args) {
     sb.ninodes = NINODES;
     sb.inodestart = 1;  // 0 for superblock
     sb.bmapstart = 1 + ninodesblocks;
+    sb.refstart = sb.bmapstart + nbitmap;
     Log("sb: magic=0x%x size=%d nblocks=%d ninodes=%d inodestart=%d "
-        "bmapstart=%d",
-        sb.magic, sb.size, sb.nblocks, sb.ninodes, sb.inodestart, sb.bmapstart);
+        "bmapstart=%d refstart=%d",
+        sb.magic, sb.size, sb.nblocks, sb.ninodes, sb.inodestart, sb.bmapstart,
+        sb.refstart);
+    pinclear();  // the snaps of the dropped inodes free nothing
+    iinval();
+    d_clear();
 
     memset(buf, 0, BSIZE);
     memcpy(buf, &sb, sizeof(sb));
@@ -552,6 +2491,7 @@ int cmd_f(char *args) {
     memset(buf, 0, BSIZE);
     for (int i = 0; i < sb.size; i += BPB) bwrite(BBLOCK(i), buf);
     for (int i = 0; i < NINODES; i += IPB) bwrite(IBLOCK(i), buf);
+    for (int i = 0; i < nrefs; i++) bwrite(sb.refstart + i, buf);
 
     // mark meta blocks as in use
     for (int i = 0; i < nmeta; i += BPB) {
@@ -572,7 +2512,7 @@ int cmd_f(char *args) {
 // if name is valid for file or dir
 int is_name_valid(char *name) {
     int len = strlen(name);
-    if (len >= MAXNAME) return 0;
+    if (len == 0 || len >= MAXNAME) return 0;
     if (name[0] == '.') return 0;
     if (strcmp(name, "/") == 0) return 0;
     // static char invalid[] = "\\/<>?\":| @#$&();*";
@@ -583,73 +2523,114 @@ int is_name_valid(char *name) {
     return 1;
 }
 
-// find in pwd
+// find in directory pinum
 // NINODES for not found
 // return inum of the file
-uint findinum(char *name) {
-    struct inode *ip = iget(user->pwd);
+uint findinum(uint pinum, char *name) {
+    struct inode *ip = iget(pinum);
     CheckIP(NINODES);
+    ilockr(ip);
+    uint result = ip->type == T_DIR ? dirlookup(ip, name) : NINODES;
+    iunlockput(ip);
+    return result;
+}
 
-    uchar *buf = malloc(ip->size);
-    readi(ip, buf, 0, ip->size);
-    struct dirent *de = (struct dirent *)buf;
-
-    int result = NINODES;
-    int nfile = ip->size / sizeof(struct dirent);
-    for (int i = 0; i < nfile; i++) {
-        if (de[i].inum == NINODES) continue;  // deleted
-        if (strcmp(de[i].name, name) == 0) {
-            result = de[i].inum;
+// walk path to the directory holding its last component
+// absolute paths start from root, others from pwd
+// every directory on the way must be readable
+// set *name to the last component, "" if there is none (such as "/")
+// return inum of the directory, NINODES for error
+// path is changed
+uint nameiparent(char *path, char **name) {
+    uint inum = path[0] == '/' ? 0 : user->pwd;
+    char *ptr = NULL;
+    char *p = strtok_r(path, "/", &ptr);
+    *name = "";
+    while (p) {
+        char *next = strtok_r(NULL, "/", &ptr);
+        if (!next) {
+            *name = p;
             break;
         }
+        inum = findinum(inum, p);
+        if (inum == NINODES) {
+            PrtNo("Not found!");
+            return NINODES;
+        }
+        if (!checkPerm(inum, R)) {
+            PrtNo("Permission denied");
+            return NINODES;
+        }
+        struct inode *ip = iget(inum);
+        CheckIP(NINODES);
+        int isdir = ip->type == T_DIR;
+        iput(ip);
+        if (!isdir) {
+            PrtNo("Not a directory");
+            return NINODES;
+        }
+        p = next;
     }
-    free(buf);
-    free(ip);
-    return result;
+    return inum;
 }
 
-// delete inode from pwd
-int delinum(uint inum) {
-    struct inode *ip = iget(user->pwd);
-    CheckIP(0);
-
-    uchar *buf = malloc(ip->size);
-    readi(ip, buf, 0, ip->size);
-    struct dirent *de = (struct dirent *)buf;
+// walk path to its inum
+// return NINODES for error
+// path is changed
+uint namei(char *path) {
+    char *name;
+    uint pinum = nameiparent(path, &name);
+    if (pinum == NINODES || !*name) return pinum;
+    uint inum = findinum(pinum, name);
+    if (inum == NINODES) PrtNo("Not found!");
+    return inum;
+}
 
-    int nfile = ip->size / sizeof(struct dirent);
-    int deleted = 1;
-    for (int i = 0; i < nfile; i++) {
-        if (de[i].inum == NINODES) {
-            ++deleted;
-            continue;  // deleted
-        }
-        if (de[i].inum == inum) {
-            de[i].inum = NINODES;
-            writei(ip, (uchar *)&de[i], i * sizeof(struct dirent),
-                   sizeof(struct dirent));
-        }
+// delete entry name of inode inum from directory ip, held locked
+// the slot is reused by the next icreate in it
+int delinum(struct inode *ip, uint inum, char *name) {
+    struct dirent de;
+    int slot = dirfind(ip, name, &de);
+    if (slot < 0 || de.inum != inum) {
+        Warn("delinum: %s is not inode %d", name, inum);
+        return 1;
     }
+    de.inum = NINODES;
+    writei(ip, (uchar *)&de, slot * sizeof(de), sizeof(de));
+    dx_del(ip, name, slot);
+    d_add(ip->inum, name, NINODES);
+    slot_push(dirslots(ip), slot);
+    if (slot == ip->size / sizeof(de) - 1) dirtrim(ip);
+    return 0;
+}
 
-    if (deleted > nfile / 2) {
-        int newn = nfile - deleted, newsiz = newn * sizeof(struct dirent);
-        uchar *newbuf = malloc(newsiz);
-        struct dirent *newde = (struct dirent *)newbuf;
-        int j = 0;
-        for (int i = 0; i < nfile; i++) {
-            if (de[i].inum == NINODES) continue;  // deleted
-            memcpy(&newde[j++], &de[i], sizeof(struct dirent));
-        }
-        assert(j == newn);
-        ip->size = newsiz;
-        writei(ip, newbuf, 0, newsiz);
-        free(newbuf);
-        itest(ip);  // try to shrink
+// make a file or dir at path
+// return its inum, or NINODES after replying No
+static uint mkpath(short type, char *path, int argc, char *argv[]) {
+    char *name;
+    uint pinum = nameiparent(path, &name);
+    if (pinum == NINODES) return NINODES;
+    if (!is_name_valid(name)) {
+        PrtNo("Invalid name!");
+        return NINODES;
     }
-
-    free(buf);
-    free(ip);
-    return 0;
+    struct inode *ip = iget(pinum);
+    CheckIP(NINODES);
+    ilock(ip);  // so no one else makes the same name meanwhile
+    uint inum = NINODES;
+    if (ip->type != T_DIR)  // removed since the walk
+        PrtNo("Not found!");
+    else if (dirlookup(ip, name) != NINODES)
+        PrtNo("Already exists!");
+    else if (!checkPerm(pinum, R | W))
+        PrtNo("Permission denied");
+    else {
+        short mode = argc >= 2 ? (atoi(argv[1]) & 0b1111) : 0b1110;
+        if (!icreate(type, name, pinum, user->uid, mode))
+            inum = dirlookup(ip, name);
+    }
+    iunlockput(ip);
+    return inum;
 }
 
 int cmd_mk(char *args) {
@@ -659,17 +2640,7 @@ int cmd_mk(char *args) {
         PrtNo("Usage: mk <filename>");
         return 0;
     }
-    if (!is_name_valid(argv[0])) {
-        PrtNo("Invalid name!");
-        return 0;
-    }
-    if (findinum(argv[0]) != NINODES) {
-        PrtNo("Already exists!");
-        return 0;
-    }
-    CheckPerm(user->pwd, R | W);
-    short mode = argc >= 2 ? (atoi(argv[1]) & 0b1111) : 0b1110;
-    if (!icreate(T_FILE, argv[0], user->pwd, user->uid, mode)) PrtYes();
+    if (mkpath(T_FILE, argv[0], argc, argv) != NINODES) PrtYes();
     return 0;
 }
 int cmd_mkdir(char *args) {
@@ -679,70 +2650,131 @@ int cmd_mkdir(char *args) {
         PrtNo("Usage: mkdir <dirname>");
         return 0;
     }
-    if (!is_name_valid(argv[0])) {
+    if (mkpath(T_DIR, argv[0], argc, argv) != NINODES) PrtYes();
+    return 0;
+}
+// get the parent directory of path locked, for rm and rmdir
+// return NULL after replying No
+static struct inode *lockparent(char *path, char **name) {
+    uint pinum = nameiparent(path, name);
+    if (pinum == NINODES) return NULL;
+    if (!is_name_valid(*name)) {
         PrtNo("Invalid name!");
-        return 0;
+        return NULL;
     }
-    if (findinum(argv[0]) != NINODES) {
-        PrtNo("Already exists!");
-        return 0;
+    struct inode *ip = iget(pinum);
+    CheckIP(NULL);
+    ilock(ip);
+    if (ip->type != T_DIR) {  // removed since the walk
+        PrtNo("Not found!");
+        iunlockput(ip);
+        return NULL;
     }
-    CheckPerm(user->pwd, R | W);
-    short mode = argc >= 2 ? (atoi(argv[1]) & 0b1111) : 0b1110;
-    if (!icreate(T_DIR, argv[0], user->pwd, user->uid, mode)) PrtYes();
-    return 0;
+    return ip;
 }
-int cmd_rm(char *args) {
-    CheckFmt();
-    Parse(MAXARGS);
-    if (argc < 1) {
-        PrtNo("Usage: rm <filename>");
-        return 0;
-    }
-    uint inum = findinum(argv[0]);
+
+// remove file name from directory dp, held locked
+static int rmfile(struct inode *dp, char *name) {
+    uint inum = dirlookup(dp, name);
     if (inum == NINODES) {
         PrtNo("Not found!");
         return 0;
     }
     CheckPerm(inum, W);
-    CheckPerm(user->pwd, R | W);
+    CheckPerm(dp->inum, R | W);
     struct inode *ip = iget(inum);
     CheckIP(0);
     if (ip->type != T_FILE) {
         PrtNo("Not a file, please use rmdir");
-        free(ip);
+        iput(ip);
         return 0;
     }
-    if (--ip->nlink == 0) {
-        itrunc(ip);
-    } else {
-        iupdate(ip);
-    }
-    free(ip);
+    ilock(ip);
+    ip->nlink--;
+    iupdate(ip);
+    iunlockput(ip);  // frees it if no link is left and it is not open
 
-    delinum(inum);
+    delinum(dp, inum, name);
     PrtYes();
     return 0;
 }
 
-// cd in pwd
-// 0 for success
-int _cd(char *name) {
-    uint inum = findinum(name);
-    if (inum == NINODES) {
-        PrtNo("Not found!");
-        return 1;
+int cmd_rm(char *args) {
+    CheckFmt();
+    Parse(MAXARGS);
+    if (argc < 1) {
+        PrtNo("Usage: rm <filename>");
+        return 0;
+    }
+    char *name;
+    struct inode *dp = lockparent(argv[0], &name);
+    if (!dp) return 0;
+    rmfile(dp, name);
+    iunlockput(dp);
+    return 0;
+}
+
+int cmd_cp(char *args) {
+    CheckFmt();
+    Parse(MAXARGS);
+    if (argc < 2) {
+        PrtNo("Usage: cp <src> <dst>");
+        return 0;
     }
+    uint inum = namei(argv[0]);
+    if (inum == NINODES) return 0;
     CheckPerm(inum, R);
     struct inode *ip = iget(inum);
     CheckIP(0);
-    if (ip->type != T_DIR) {
-        PrtNo("Not a directory");
-        free(ip);
-        return 1;
+    if (ip->type != T_FILE) {
+        PrtNo("Not a file");
+        iput(ip);
+        return 0;
     }
-    user->pwd = inum;
-    free(ip);
+    char dst[strlen(argv[1]) + 1];  // mkpath changes it
+    strcpy(dst, argv[1]);
+    uint dinum = mkpath(T_FILE, argv[1], 1, NULL);
+    if (dinum == NINODES) {
+        iput(ip);
+        return 0;
+    }
+    struct inode *dp = iget(dinum);
+    if (!dp) {  // removed meanwhile
+        iput(ip);
+        PrtNo("Not found!");
+        return 0;
+    }
+    // two files locked, in inum order so cp a b and cp b a cannot deadlock
+    if (ip->inum < dp->inum) {
+        ilockr(ip);
+        ilock(dp);
+    } else {
+        ilock(dp);
+        ilockr(ip);
+    }
+    int ret = icopy(ip, dp);
+    iunlockput(ip);
+    iunlock(dp);
+    if (ret < 0) {  // take the new file back, unless removed meanwhile
+        char *name;
+        struct inode *pp = lockparent(dst, &name);
+        if (!pp) {
+            iput(dp);
+            return 0;
+        }
+        if (!delinum(pp, dinum, name)) {
+            ilock(dp);
+            dp->nlink--;
+            iupdate(dp);
+            iunlock(dp);
+        }
+        iunlockput(pp);
+        iput(dp);  // frees it
+        PrtNo("No space");
+        return 0;
+    }
+    iput(dp);
+    PrtYes();
     return 0;
 }
 
@@ -753,43 +2785,39 @@ int cmd_cd(char *args) {
         PrtNo("Usage: cd <dirname>");
         return 0;
     }
-    char *ptr = NULL;
-    int backup = user->pwd;
-    if (argv[0][0] == '/') user->pwd = 0;  // start from root
-    char *p = strtok_r(argv[0], "/", &ptr);
-    while (p) {
-        if (_cd(p) != 0) {       // if not success
-            user->pwd = backup;  // restore the pwd
-            return 0;
-        }
-        p = strtok_r(NULL, "/", &ptr);
+    uint inum = namei(argv[0]);
+    if (inum == NINODES) return 0;
+    CheckPerm(inum, R);
+    struct inode *ip = iget(inum);
+    CheckIP(0);
+    if (ip->type != T_DIR) {
+        PrtNo("Not a directory");
+        iput(ip);
+        return 0;
     }
+    user->pwd = inum;
+    iput(ip);
 
     PrtYes();
     return 0;
 }
-// rm empty dir
-int cmd_rmdir(char *args) {
-    CheckFmt();
-    Parse(MAXARGS);
-    if (argc < 1) {
-        PrtNo("Usage: rmdir <dirname>");
-        return 0;
-    }
-    uint inum = findinum(argv[0]);
+// remove empty dir name from directory dp, held locked
+static int rmdirat(struct inode *dp, char *name) {
+    uint inum = dirlookup(dp, name);
     if (inum == NINODES) {
         PrtNo("Not found!");
         return 0;
     }
     CheckPerm(inum, R | W);
-    CheckPerm(user->pwd, R | W);
+    CheckPerm(dp->inum, R | W);
     struct inode *ip = iget(inum);
     CheckIP(0);
     if (ip->type != T_DIR) {
         PrtNo("Not a dir, please use rm");
-        free(ip);
+        iput(ip);
         return 0;
     }
+    ilock(ip);
 
     // if dir is not empty
     int empty = 1;
@@ -809,20 +2837,39 @@ int cmd_rmdir(char *args) {
 
     if (!empty) {
         PrtNo("Directory not empty!");
-        free(ip);
+        iunlockput(ip);
+        return 0;
+    }
+
+    // ok, delete
+    dxfree(dxidx(ip));
+    d_purge(inum);
+    idel(ip);
+    iunlockput(ip);
+    delinum(dp, inum, name);
+    PrtYes();
+    return 0;
+}
+
+// rm empty dir
+int cmd_rmdir(char *args) {
+    CheckFmt();
+    Parse(MAXARGS);
+    if (argc < 1) {
+        PrtNo("Usage: rmdir <dirname>");
         return 0;
     }
-
-    // ok, delete
-    itrunc(ip);
-    free(ip);
-    delinum(inum);
-    PrtYes();
+    char *name;
+    struct inode *dp = lockparent(argv[0], &name);
+    if (!dp) return 0;
+    rmdirat(dp, name);
+    iunlockput(dp);
     return 0;
 }
 
 // for ls
 struct entry {
+    uint inum;
     short type;
     short uid;
     short mode;
@@ -844,65 +2891,217 @@ int cmp_ls(const void *a, const void *b) {
     return strcmp(da->name, db->name);
 }
 
-// do not check if pwd is valid
-// now no arg
-int cmd_ls(char *args) {
-    CheckFmt();
-    CheckPerm(user->pwd, R);
-    struct inode *ip = iget(user->pwd);
-    CheckIP(0);
+static int cmp_inum(const void *a, const void *b) {
+    return cmp_uint(&((struct entry *)a)->inum, &((struct entry *)b)->inum);
+}
 
-    uchar *buf = malloc(ip->size);
-    readi(ip, buf, 0, ip->size);
-    struct dirent *de = (struct dirent *)buf;
+// fill the entries from their inodes, the snaps of the cached ones
+// inodes not cached are read once per inode block, with pipelined requests
+// entries of files removed meanwhile are dropped
+// return the number of entries left
+static int ls_stat(struct entry *e, int n) {
+    qsort(e, n, sizeof(struct entry), cmp_inum);
+    int *bnos = malloc(n * sizeof(int)), nb = 0;
+    // hold the cached ones, so they stay while read below
+    struct inode **ips = malloc(n * sizeof(struct inode *));
+    acquire(&icachelock);
+    for (int i = 0; i < n; i++) {
+        struct inode *ip = ips[i] = icache[e[i].inum];
+        if (ip && ip->ref++ == 0) lru_del(ip);
+        if (!ip && (nb == 0 || bnos[nb - 1] != IBLOCK(e[i].inum)))
+            bnos[nb++] = IBLOCK(e[i].inum);
+    }
+    release(&icachelock);
+    uchar *bufs = malloc(nb * BSIZE);
+    bfetch(nb, bnos, bufs);
+
+    for (int i = 0, k = 0; i < n; i++) {
+        struct inode *ip = ips[i];
+        if (ip) {
+            struct snap *s = snapget(ip, 0);
+            e[i].type = s->type;
+            e[i].mtime = s->mtime;
+            e[i].uid = s->uid;
+            e[i].mode = s->mode;
+            e[i].size = s->size;
+            snapput(ip, s);
+            iput(ip);
+            continue;
+        }
+        while (bnos[k] != IBLOCK(e[i].inum)) k++;
+        struct dinode *dip = (struct dinode *)(bufs + k * BSIZE);
+        dip += e[i].inum % IPB;
+        e[i].type = dip->type;
+        e[i].mtime = dip->mtime;
+        e[i].uid = dip->uid;
+        e[i].mode = dip->mode;
+        e[i].size = dip->size;
+    }
+    Debug("ls_stat: %d inodes in %d blocks", n, nb);
+    free(ips);
+    free(bufs);
+    free(bnos);
+    int m = 0;
+    for (int i = 0; i < n; i++)
+        if (e[i].type) e[m++] = e[i];
+    return m;
+}
 
-    int nfile = ip->size / sizeof(struct dirent), n = 0;
-    struct entry *entries = malloc(nfile * sizeof(struct entry));
-    for (int i = 0; i < nfile; i++) {
+// print an entry of ls
+static void ls_print(struct entry *e) {
+    char str[100];  // for time
+    time_t mtime = e->mtime;
+    struct tm tm;
+    strftime(str, sizeof(str), "%m-%d %H:%M", localtime_r(&mtime, &tm));
+    short d = e->type == T_DIR;
+    short m = (d << 4) | e->mode;
+    static char a[] = "drwrw";
+    msgroom(128);
+    for (int j = 0; j <= 4; j++)
+        msgprintf("%c", m & (1 << (4 - j)) ? a[j] : '-');
+    msgprintf("\t%u\t%s\t%d\t", e->uid, str, e->size);
+    msgprintf(d ? "\033[34m\33[1m%s\033[0m\n" : "%s\n", e->name);
+    Debug("\t%u\t%s\t%d\t%s", e->uid, str, e->size, e->name);
+}
+
+// copy the entries of a directory except ".", ".." and deleted ones
+// return the number of entries
+static int ls_collect(struct dirent *de, int nde, struct entry *e) {
+    int n = 0;
+    for (int i = 0; i < nde; i++) {
         if (de[i].inum == NINODES) continue;  // deleted
         if (strcmp(de[i].name, ".") == 0 || strcmp(de[i].name, "..") == 0)
             continue;
-        struct inode *sub = iget(de[i].inum);
-        CheckIP(0);
-        entries[n].type = sub->type;
-        strcpy(entries[n].name, de[i].name);
-        entries[n].mtime = sub->mtime;
-        entries[n].uid = sub->uid;
-        entries[n].mode = sub->mode;
-        entries[n++].size = sub->size;
-        free(sub);
+        e[n].inum = de[i].inum;
+        strcpy(e[n++].name, de[i].name);
+    }
+    return n;
+}
+
+// list up to limit entries of a directory snap from slot cursor, unsorted
+// one directory block is read, stated and sent at a time
+static void ls_page(struct snap *s, uint cursor, uint limit) {
+    struct dirent de[DPB];
+    struct entry e[DPB];
+    uint nfile = s->size / sizeof(struct dirent), n = 0;
+    while (cursor < nfile && n < limit) {
+        uint end = min(nfile, (cursor / DPB + 1) * DPB);  // end of the block
+        end = min(end, cursor + limit - n);  // at most limit entries
+        snapread(s, (uchar *)de, cursor * sizeof(struct dirent),
+                 (end - cursor) * sizeof(struct dirent));
+        int m = ls_collect(de, end - cursor, e);
+        m = ls_stat(e, m);
+        for (int i = 0; i < m; i++) ls_print(&e[i]);
+        msgflush();  // send what is listed so far
+        n += m;
+        cursor = end;
+    }
+    while (cursor < nfile) {  // skip deleted entries before the next page
+        snapread(s, (uchar *)de, cursor * sizeof(struct dirent),
+                 sizeof(struct dirent));
+        if (de[0].inum != NINODES) break;
+        cursor++;
+    }
+    if (cursor < nfile)
+        msgprintf("Next %u\n", cursor);
+    else
+        msgprintf("End\n");
+    Log("List %u files", n);
+}
+
+// do not check if pwd is valid
+// ls [dirname]: list all, sorted
+// ls [dirname] <cursor> <limit>: list a page, in directory order
+// the directory is listed as committed when ls starts, changes made
+// meanwhile neither wait for it nor show up in it
+int cmd_ls(char *args) {
+    CheckFmt();
+    Parse(MAXARGS);
+    uint inum = user->pwd;
+    if (argc == 1 || argc >= 3) {  // with dirname
+        inum = namei(argv[0]);
+        if (inum == NINODES) return 0;
+        argc--;
+        memmove(argv, argv + 1, argc * sizeof(char *));
+    }
+    CheckPerm(inum, R);
+    struct inode *ip = iget(inum);
+    CheckIP(0);
+    struct snap *s = snapget(ip, 1);
+    if (s->type != T_DIR) {
+        PrtNo("Not a directory");
+        snapput(ip, s);
+        iput(ip);
+        return 0;
+    }
+    unsigned long cursor, limit;
+    if (argc >= 2 && (parsenum(argv[0], &cursor) < 0 ||
+                      parsenum(argv[1], &limit) < 0 || limit == 0)) {
+        PrtNo("Usage: ls [dirname] <cursor> <limit>, limit > 0");
+        snapput(ip, s);
+        iput(ip);
+        return 0;
     }
-    qsort(entries, n, sizeof(struct entry), cmp_ls);
-    static char str[100];  // for time
-    static char logbuf[4096], *logtmp;
     msgprintf("\33[1mType \tOwner\tUpdate time\tSize\tName\033[0m\n");
-    logtmp = logbuf;
-    logtmp +=
-        sprintf(logtmp, "List files\nType \tOwner\tUpdate time\tSize\tName\n");
-    for (int i = 0; i < n; i++) {
-        time_t mtime = entries[i].mtime;
-        struct tm *tmptr = localtime(&mtime);
-        strftime(str, sizeof(str), "%m-%d %H:%M", tmptr);
-        short d = entries[i].type == T_DIR;
-        short m = (d << 4) | entries[i].mode;
-        static char a[] = "drwrw";
-        for (int j = 0; j <= 4; j++) {
-            msgprintf("%c", m & (1 << (4 - j)) ? a[j] : '-');
-            logtmp += sprintf(logtmp, "%c", m & (1 << (4 - j)) ? a[j] : '-');
-        }
-        msgprintf("\t%u\t%s\t%d\t", entries[i].uid, str, entries[i].size);
-        msgprintf(d ? "\033[34m\33[1m%s\033[0m\n" : "%s\n", entries[i].name);
-        // WARN: BUFFER OVERFLOW
-        logtmp += sprintf(logtmp, "\t%u\t%s\t%d\t%s\n", entries[i].uid, str,
-                          entries[i].size, entries[i].name);
+    if (argc >= 2) {
+        uint nfile = s->size / sizeof(struct dirent);  // both fit after it
+        ls_page(s, cursor < nfile ? cursor : nfile,
+                limit < nfile ? limit : nfile);
+        snapput(ip, s);
+        iput(ip);
+        return 0;
     }
-    Log("%s", logbuf);
-    free(entries);
+
+    uchar *buf = malloc(s->size);
+    snapread(s, buf, 0, s->size);
+    int nfile = s->size / sizeof(struct dirent);
+    struct entry *entries = malloc(nfile * sizeof(struct entry));
+    int n = ls_collect((struct dirent *)buf, nfile, entries);
     free(buf);
-    free(ip);
+    n = ls_stat(entries, n);
+    qsort(entries, n, sizeof(struct entry), cmp_ls);
+    for (int i = 0; i < n; i++) ls_print(&entries[i]);
+    Log("List %d files", n);
+    free(entries);
+    snapput(ip, s);
+    iput(ip);
 
     return 0;
 }
+// blocks fetched and sent at a time when streaming a file
+#define NCHUNK 16
+
+// stream bytes [off, off + n) of a filled snap to the client
+// NCHUNK blocks are read pipelined, then sent from the read buffer
+// return 0 for success, -1 if the client is gone
+static int sendi(struct snap *s, uint off, uint n) {
+    static uchar zeros[BSIZE];  // holes are sent from here
+    uchar *buf = malloc(NCHUNK * BSIZE);
+    struct iovec iov[NCHUNK];
+    int bnos[NCHUNK];
+    uint boff, bn = snapfind(s, off, &boff);
+    int ret = 0;
+    while (n > 0 && ret == 0) {
+        int k, nr = 0;
+        for (k = 0; k < NCHUNK && n > 0; k++, bn++, boff = 0) {
+            uint e = s->e[bn];
+            uint m = min(n, BFILL(e) - boff);
+            if (BNO(e)) {
+                bnos[nr] = BNO(e);
+                iov[k].iov_base = buf + nr++ * BSIZE + boff;
+            } else {
+                iov[k].iov_base = zeros + boff;
+            }
+            iov[k].iov_len = m;
+            n -= m;
+        }
+        breadn(nr, bnos, buf);
+        ret = sendrawv(iov, k);
+    }
+    free(buf);
+    return ret;
+}
+
 int cmd_cat(char *args) {
     CheckFmt();
     Parse(MAXARGS);
@@ -910,28 +3109,63 @@ int cmd_cat(char *args) {
         PrtNo("Usage: cat <filename>");
         return 0;
     }
-    uint inum = findinum(argv[0]);
-    if (inum == NINODES) {
-        PrtNo("Not found!");
-        return 0;
-    }
+    uint inum = namei(argv[0]);
+    if (inum == NINODES) return 0;
     CheckPerm(inum, R);
     struct inode *ip = iget(inum);
     CheckIP(0);
     if (ip->type != T_FILE) {
         PrtNo("Not a file");
-        free(ip);
+        iput(ip);
         return 0;
     }
+    // a slow client holds up no writer, it reads the file as it was
+    struct snap *s = snapget(ip, 1);
+    if (sendi(s, 0, s->size) == 0) sendraw("\n", 1);
+    Log("Cat %d bytes", s->size);
 
-    uchar *buf = malloc(ip->size + 2);
-    readi(ip, buf, 0, ip->size);
-    buf[ip->size] = '\n';
-    buf[ip->size + 1] = '\0';
-    send(connfd, buf, ip->size + 1, 0);
+    snapput(ip, s);
+    iput(ip);
+    return 0;
+}
+// reply to read, with offset and length as given by the client
+// like pread, read less at EOF and nothing after it
+static void preadi(struct inode *ip, char *offarg, char *lenarg) {
+    unsigned long o, l;
+    if (parsenum(offarg, &o) < 0 || parsenum(lenarg, &l) < 0) {
+        PrtNo("Bad offset or length");
+        return;
+    }
+    struct snap *s = snapget(ip, 1);
+    // clamp before narrowing, an offset past 4G is past EOF, not 0
+    uint off = o < s->size ? o : s->size;
+    uint n = l < s->size - off ? l : s->size - off;
+    msgprintf("Yes %u\n", n);  // the length goes first, data may be binary
+    msgflush();
+    sendi(s, off, n);
+    Log("Read %u bytes at %u", n, off);
+    snapput(ip, s);
+}
 
-    free(buf);
-    free(ip);
+int cmd_read(char *args) {
+    CheckFmt();
+    Parse(MAXARGS);
+    if (argc < 3) {
+        PrtNo("Usage: read <filename> <offset> <length>");
+        return 0;
+    }
+    uint inum = namei(argv[0]);
+    if (inum == NINODES) return 0;
+    CheckPerm(inum, R);
+    struct inode *ip = iget(inum);
+    CheckIP(0);
+    if (ip->type != T_FILE) {
+        PrtNo("Not a file");
+        iput(ip);
+        return 0;
+    }
+    preadi(ip, argv[1], argv[2]);
+    iput(ip);
     return 0;
 }
 int cmd_w(char *args) {
@@ -941,29 +3175,31 @@ int cmd_w(char *args) {
         PrtNo("Usage: w <filename> <length> <data>");
         return 0;
     }
-    uint inum = findinum(argv[0]);
-    if (inum == NINODES) {
-        PrtNo("Not found!");
-        return 0;
-    }
+    uint inum = namei(argv[0]);
+    if (inum == NINODES) return 0;
     CheckPerm(inum, W);
     struct inode *ip = iget(inum);
     CheckIP(0);
     if (ip->type != T_FILE) {
         PrtNo("Not a file");
-        free(ip);
+        iput(ip);
         return 0;
     }
+    ilock(ip);
 
     uint len = atoi(argv[1]);
     char *data = argv[2];
     if (len > 512 || len > strlen(data)) {
         PrtNo("Too long");
-        free(ip);
+        iunlockput(ip);
         return 0;
     }
 
-    writei(ip, (uchar *)data, 0, len);
+    if (writei(ip, (uchar *)data, 0, len) < 0) {
+        PrtNo("No space");
+        iunlockput(ip);
+        return 0;
+    }
 
     if (len < ip->size) {
         // if the new data is shorter, truncate
@@ -972,52 +3208,236 @@ int cmd_w(char *args) {
         itest(ip);
     }
 
-    free(ip);
+    iunlockput(ip);
     PrtYes();
     return 0;
 }
-int cmd_i(char *args) {
+// reply to write, with offset, length and data as given by the client
+// like pwrite, writing past EOF leaves a hole that takes no blocks
+static void pwritei(struct inode *ip, char *offarg, char *lenarg, char *data) {
+    unsigned long off, len;
+    if (parsenum(offarg, &off) < 0 || parsenum(lenarg, &len) < 0) {
+        PrtNo("Bad offset or length");
+        return;
+    }
+    if (len > 512 || len > strlen(data) || off > MAXFILEB * BSIZE) {
+        PrtNo("Too long");
+        return;
+    }
+    if (writei(ip, (uchar *)data, off, len) < 0)
+        PrtNo("Too long");
+    else
+        PrtYes();
+}
+
+int cmd_write(char *args) {
     CheckFmt();
     Parse(3);
     if (argc < 3) {
-        PrtNo("Usage: i <filename> <pos> <length> <data>");
+        PrtNo("Usage: write <filename> <offset> <length> <data>");
         return 0;
     }
-    uint inum = findinum(argv[0]);
-    if (inum == NINODES) {
-        PrtNo("Not found!");
+    uint inum = namei(argv[0]);
+    if (inum == NINODES) return 0;
+    CheckPerm(inum, W);
+    struct inode *ip = iget(inum);
+    CheckIP(0);
+    if (ip->type != T_FILE) {
+        PrtNo("Not a file");
+        iput(ip);
+        return 0;
+    }
+    ilock(ip);
+    pwritei(ip, argv[1], argv[2], argv[3]);
+    iunlockput(ip);
+    return 0;
+}
+// throw away n raw bytes the client sends after a failed command
+static void discard(uint n) {
+    char buf[BSIZE];
+    for (uint m; n > 0; n -= m) {
+        m = min(n, BSIZE);
+        if (recvraw(buf, m) < 0) return;
+    }
+}
+
+// parse the length of the raw bytes following a command into len
+// return -1 after replying No if it is not a number or too large; the
+// bytes are not read away then, as there is no telling how many follow
+static int rawlen(char *arg, uint *len) {
+    unsigned long n;
+    if (parsenum(arg, &n) < 0 || n > MAXFILEB * BSIZE) {
+        PrtNo("Bad length");
+        return -1;
+    }
+    *len = n;
+    return 0;
+}
+
+// find the file of a command followed by len raw bytes, and lock it
+// len is checked by rawlen
+// on errors, reply No and read the bytes away
+static struct inode *rawopen(char *path, uint len) {
+    uint inum = namei(path);
+    if (inum == NINODES || !checkPerm(inum, W)) {
+        if (inum != NINODES) PrtNo("Permission denied");
+        discard(len);
+        return NULL;
+    }
+    struct inode *ip = iget(inum);
+    if (!ip || ip->type != T_FILE) {
+        PrtNo("Not a file");
+        if (ip) iput(ip);
+        discard(len);
+        return NULL;
+    }
+    ilock(ip);
+    return ip;
+}
+
+// write len raw bytes from the client to off of the inode, NCHUNK blocks
+// at a time as they arrive
+// return 0 for success, -1 if no space or the client is gone
+static int recvi(struct inode *ip, uint off, uint len) {
+    uchar *buf = malloc(NCHUNK * BSIZE);
+    int ret = 0;
+    for (uint m; len > 0; off += m, len -= m) {
+        m = min(len, NCHUNK * BSIZE);
+        if (recvraw((char *)buf, m) < 0) {
+            ret = -1;  // client is gone, keep what has arrived
+            break;
+        }
+        if (ret == 0 && writei(ip, buf, off, m) < 0) ret = -1;  // no space
+    }
+    free(buf);
+    return ret;
+}
+
+int cmd_put(char *args) {
+    CheckFmt();
+    Parse(MAXARGS);
+    if (argc < 2) {
+        PrtNo("Usage: put <filename> <length>");
+        return 0;
+    }
+    // the data follows the line, so it must be read even on errors
+    uint len;
+    if (rawlen(argv[1], &len) < 0) return 0;
+    struct inode *ip = rawopen(argv[0], len);
+    if (!ip) return 0;
+
+    int ret = recvi(ip, 0, len);
+    if (ret == 0 && len < ip->size) {
+        // if the new data is shorter, truncate
+        ip->size = len;
+        iupdate(ip);
+        itest(ip);
+    }
+    iunlockput(ip);
+    if (ret == 0)
+        PrtYes();
+    else
+        PrtNo("Put failed");
+    return 0;
+}
+int cmd_append(char *args) {
+    CheckFmt();
+    Parse(2);
+    if (argc < 2) {
+        PrtNo("Usage: append <filename> <length> <data>");
+        return 0;
+    }
+    uint inum = namei(argv[0]);
+    if (inum == NINODES) return 0;
+    CheckPerm(inum, W);
+    struct inode *ip = iget(inum);
+    CheckIP(0);
+    if (ip->type != T_FILE) {
+        PrtNo("Not a file");
+        iput(ip);
+        return 0;
+    }
+    ilock(ip);
+    uint len = atoi(argv[1]);
+    char *data = argv[2];
+    if (len > 512 || len > strlen(data)) {
+        PrtNo("Too long");
+        iunlockput(ip);
+        return 0;
+    }
+
+    // the tail block is cached, so this is one write per block
+    int ret = writei(ip, (uchar *)data, ip->size, len);
+    iunlockput(ip);
+    if (ret < 0)
+        PrtNo("Too long");
+    else
+        PrtYes();
+    return 0;
+}
+int cmd_appendb(char *args) {
+    CheckFmt();
+    Parse(MAXARGS);
+    if (argc < 2) {
+        PrtNo("Usage: appendb <filename> <length>");
+        return 0;
+    }
+    uint len;
+    if (rawlen(argv[1], &len) < 0) return 0;
+    struct inode *ip = rawopen(argv[0], len);
+    if (!ip) return 0;
+
+    int ret = recvi(ip, ip->size, len);
+    iunlockput(ip);
+    if (ret == 0)
+        PrtYes();
+    else
+        PrtNo("Append failed");
+    return 0;
+}
+int cmd_i(char *args) {
+    CheckFmt();
+    Parse(3);
+    if (argc < 3) {
+        PrtNo("Usage: i <filename> <pos> <length> <data>");
         return 0;
     }
+    uint inum = namei(argv[0]);
+    if (inum == NINODES) return 0;
     CheckPerm(inum, W);
     struct inode *ip = iget(inum);
     CheckIP(0);
     if (ip->type != T_FILE) {
         PrtNo("Not a file");
-        free(ip);
+        iput(ip);
+        return 0;
+    }
+    unsigned long pos, len;
+    if (parsenum(argv[1], &pos) < 0 || parsenum(argv[2], &len) < 0) {
+        PrtNo("Bad position or length");
+        iput(ip);
         return 0;
     }
-    uint pos = atoi(argv[1]);
-    uint len = atoi(argv[2]);
+    ilock(ip);
     char *data = argv[3];
     if (len > 512 || len > strlen(data)) {
         PrtNo("Too long");
-        free(ip);
+        iunlockput(ip);
         return 0;
     }
 
-    if (pos >= ip->size) {
-        pos = ip->size;
-        writei(ip, (uchar *)data, pos, len);
-    } else {
-        uchar *buf = malloc(ip->size - pos);
-        // [pos, size) -> [pos+len, size+len)
-        readi(ip, buf, pos, ip->size - pos);
-        writei(ip, (uchar *)data, pos, len);
-        writei(ip, buf, pos + len, ip->size - pos);
-        free(buf);
+    int ret;
+    if (pos >= ip->size)
+        ret = writei(ip, (uchar *)data, ip->size, len);
+    else  // [pos, size) -> [pos+len, size+len), only one block is moved
+        ret = splicei(ip, (uchar *)data, pos, len);
+    if (ret < 0) {
+        PrtNo("Too long");
+        iunlockput(ip);
+        return 0;
     }
 
-    free(ip);
+    iunlockput(ip);
     PrtYes();
     return 0;
 }
@@ -1028,41 +3448,158 @@ int cmd_d(char *args) {
         PrtNo("Usage: d <filename> <pos> <length>");
         return 0;
     }
-    uint inum = findinum(argv[0]);
-    if (inum == NINODES) {
-        PrtNo("Not found!");
-        return 0;
-    }
+    uint inum = namei(argv[0]);
+    if (inum == NINODES) return 0;
     CheckPerm(inum, W);
     struct inode *ip = iget(inum);
     CheckIP(0);
     if (ip->type != T_FILE) {
         PrtNo("Not a file");
-        free(ip);
+        iput(ip);
+        return 0;
+    }
+    unsigned long pos, len;
+    if (parsenum(argv[1], &pos) < 0 || parsenum(argv[2], &len) < 0 ||
+        pos + len < pos) {
+        PrtNo("Bad position or length");
+        iput(ip);
+        return 0;
+    }
+    ilock(ip);
+    if (pos > ip->size) {
+        PrtNo("Past the end of file");
+        iunlockput(ip);
         return 0;
     }
-    uint pos = atoi(argv[1]);
-    uint len = atoi(argv[2]);
 
     if (pos + len >= ip->size) {
-        ip->size = pos;
-        iupdate(ip);
+        isize(ip, pos);  // the rest of the file goes
     } else {
-        // [pos + len, size) -> [pos, size - len)
-        uint copylen = ip->size - pos - len;
-        uchar *buf = malloc(copylen);
-        readi(ip, buf, pos + len, copylen);
-        writei(ip, buf, pos, copylen);
-        ip->size -= len;
-        iupdate(ip);
+        // [pos + len, size) -> [pos, size - len), only the ends are moved
+        if (spliced(ip, pos, len) < 0) {
+            PrtNo("No space");
+            iunlockput(ip);
+            return 0;
+        }
         itest(ip);  // try to shrink
-        free(buf);
     }
 
-    free(ip);
+    iunlockput(ip);
+    PrtYes();
+    return 0;
+}
+// the open handle named by arg, allowing perm
+// return NULL after replying No
+static struct handle *hget(char *arg, short perm) {
+    char *end;
+    long h = strtol(arg, &end, 10);
+    if (*end || h < 0 || h >= NHANDLE || !user->h[h].ip) {
+        PrtNo("Bad handle");
+        return NULL;
+    }
+    struct handle *hp = &user->h[h];
+    if (hp->gen != fmtgen) {  // its inode is gone with the format
+        hp->ip = NULL;
+        PrtNo("Bad handle");
+        return NULL;
+    }
+    if ((hp->perm & perm) != perm) {
+        PrtNo("Permission denied");
+        return NULL;
+    }
+    return hp;
+}
+
+int cmd_open(char *args) {
+    CheckFmt();
+    Parse(MAXARGS);
+    if (argc < 2) {
+        PrtNo("Usage: open <filename> <r|w|rw>");
+        return 0;
+    }
+    short perm =
+        (strchr(argv[1], 'r') ? R : 0) | (strchr(argv[1], 'w') ? W : 0);
+    if (!perm) {
+        PrtNo("Invalid mode");
+        return 0;
+    }
+    int h = 0;
+    while (h < NHANDLE && user->h[h].ip && user->h[h].gen == fmtgen) h++;
+    if (h == NHANDLE) {
+        PrtNo("Too many open files");
+        return 0;
+    }
+    uint inum = namei(argv[0]);
+    if (inum == NINODES) return 0;
+    CheckPerm(inum, perm);
+    struct inode *ip = iget(inum);
+    CheckIP(0);
+    if (ip->type != T_FILE) {
+        PrtNo("Not a file");
+        iput(ip);
+        return 0;
+    }
+    user->h[h] = (struct handle){ip, perm, fmtgen};  // keeps the ref
+    msgprintf("Yes %d\n", h);
+    Log("Open inode %u as handle %d", inum, h);
+    return 0;
+}
+int cmd_hread(char *args) {
+    CheckFmt();
+    Parse(MAXARGS);
+    if (argc < 3) {
+        PrtNo("Usage: hread <handle> <offset> <length>");
+        return 0;
+    }
+    struct handle *hp = hget(argv[0], R);
+    if (!hp) return 0;
+    preadi(hp->ip, argv[1], argv[2]);
+    return 0;
+}
+int cmd_hwrite(char *args) {
+    CheckFmt();
+    Parse(3);
+    if (argc < 3) {
+        PrtNo("Usage: hwrite <handle> <offset> <length> <data>");
+        return 0;
+    }
+    struct handle *hp = hget(argv[0], W);
+    if (!hp) return 0;
+    ilock(hp->ip);
+    pwritei(hp->ip, argv[1], argv[2], argv[3]);
+    iunlock(hp->ip);
+    return 0;
+}
+int cmd_close(char *args) {
+    CheckLogin();
+    Parse(MAXARGS);
+    if (argc < 1) {
+        PrtNo("Usage: close <handle>");
+        return 0;
+    }
+    struct handle *hp = hget(argv[0], 0);
+    if (!hp) return 0;
+    iput(hp->ip);
+    hp->ip = NULL;
     PrtYes();
     return 0;
 }
+
+// close the handles of a client that is gone
+static pthread_rwlock_t fslock = PTHREAD_RWLOCK_INITIALIZER;
+
+void client_exit(void *cli) {
+    struct clientitem *c = cli;
+    rwlock(&fslock, 0);
+    for (int h = 0; h < NHANDLE; h++)
+        if (c->h[h].ip && c->h[h].gen == fmtgen) iput(c->h[h].ip);
+    iflush();  // a removed file may be freed now
+    bfree_unpinned();
+    rflush();
+    pthread_rwlock_unlock(&fslock);
+    free(c);
+}
+
 int cmd_e(char *args) {
     msgprintf("Goodbye!\n");
     Log("Exit");
@@ -1086,7 +3623,12 @@ static struct {
                  {"rm", cmd_rm},      {"cd", cmd_cd},   {"rmdir", cmd_rmdir},
                  {"ls", cmd_ls},      {"cat", cmd_cat}, {"w", cmd_w},
                  {"i", cmd_i},        {"d", cmd_d},     {"e", cmd_e},
-                 {"login", cmd_login}};
+                 {"login", cmd_login}, {"read", cmd_read},
+                 {"put", cmd_put},    {"append", cmd_append},
+                 {"appendb", cmd_appendb}, {"write", cmd_write},
+                 {"cp", cmd_cp},      {"open", cmd_open},
+                 {"hread", cmd_hread}, {"hwrite", cmd_hwrite},
+                 {"close", cmd_close}};
 
 void sbinit() {
     uchar buf[BSIZE];
@@ -1096,47 +3638,82 @@ void sbinit() {
 
 int NCMD;
 
+// commands of different clients run in parallel on the workers
+// format runs alone, as it drops every cached inode
 int serve(int fd, char *buf, int len, void *cli) {
     // command
     user = cli;
-    connfd = fd;
     buf[len] = buf[len + 1] = 0;
     Log("uid=%u use command: %s", user->uid, buf);
-    char *p = strtok(buf, " \r\n");
+    char *save;
+    char *p = strtok_r(buf, " \r\n", &save);
     if (!p) return 0;
     int ret = 1;
+    if (!msg) msg = malloc(MSGSIZE);  // the first command of the fiber
     msginit();
     for (int i = 0; i < NCMD; i++)
         if (strcmp(p, cmd_table[i].name) == 0) {
+            rwlock(&fslock, cmd_table[i].handler == cmd_f);
             ret = cmd_table[i].handler(p + strlen(p) + 1);
+            iflush();
+            bfree_unpinned();
+            rflush();
+            pthread_rwlock_unlock(&fslock);
             break;
         }
     if (ret == 1) {
         PrtNo("No such command");
     }
-    msgsend(fd);
+    sendraw(msg, msgtmp - msg);
     return ret;
 }
 
+// each worker has its own connection to the disk server, shared by its
+// fibers; the state of a command is kept apart for each fiber
+static int *diskfds;
+
+static void worker_init(int id) {
+    bioinit(diskfds[id]);
+    fiber_keep(&user, sizeof(user));
+    fiber_keep(&msg, sizeof(msg));
+    fiber_keep(&msgtmp, sizeof(msgtmp));
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) errx(1, "Usage: %s <DiskPort> <FSPort>", argv[0]);
+    if (argc < 3)
+        errx(1, "Usage: %s <DiskPort> <FSPort> [workers]", argv[0]);
     log_init("fs.log");
 
     assert(BSIZE % sizeof(struct dinode) == 0);
     assert(BSIZE % sizeof(struct dirent) == 0);
 
+    pthread_mutexattr_init(&recursive);
+    pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&alloclock, &recursive);
+
     int serverfd = init_client(atoi(argv[1]));
     Log("Connected to disk server");
     bioinit(serverfd);
+    // workers also wait on clients and the disk, so keep a few even on
+    // one core; 0 serves on the main thread
+    int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 4) nworkers = 4;
+    if (argc > 3) nworkers = atoi(argv[3]);
+    if (nworkers < 0) nworkers = 0;
+    diskfds = malloc(nworkers * sizeof(int));
+    for (int i = 0; i < nworkers; i++) diskfds[i] = init_client(atoi(argv[1]));
+    Log("%d workers", nworkers);
     binfo(&ncyl, &nsec);
     Log("ncyl=%d, nsec=%d", ncyl, nsec);
 
     sbinit();
+    d_clear();
     Log("Superblock initialized, %sformatted", sb.magic == MAGIC ? "" : "not ");
     Log("size=%u, nblocks=%u, ninodes=%u", sb.size, sb.nblocks, sb.ninodes);
 
     NCMD = sizeof(cmd_table) / sizeof(cmd_table[0]);
-    mainloop(atoi(argv[2]), client_init, serve);
+    server_workers(nworkers, worker_init);
+    mainloop(atoi(argv[2]), client_init, serve, client_exit);
 
     close(serverfd);
     log_close();
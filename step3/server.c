@@ -4,81 +4,612 @@
 
 #include "server.h"
 
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <ucontext.h>
+
 #define BUFSIZE 4096
+#define MAXLINE 65536  // A longer command line drops the client
+#define OUTMAX (64 * 1024)     // More output queued pauses the commands
+#define OUTHIGH (1024 * 1024)  // More makes a command wait for the client
+#define MAXEVENTS 64  // Events taken by one epoll_wait
+#define NFIBER 16     // Commands in flight on one worker
+#define STACKSIZE (256 * 1024)
+#define NKEEP 8       // Pieces of thread-local state kept per fiber
+
+typedef struct conn {  // A connected client
+    int fd;            // Its descriptor
+    void *client;      // State from client_init
+    char *in;          // Input not served yet, kept across reads
+    int inoff, inlen;  // It is in[inoff, inoff + inlen)
+    int incap;         // Size of in, NULL while nothing is kept
+    char *out;         // Replies not sent yet
+    int outoff, outlen, outcap;  // Like in
+    int eof;           // No more input comes
+    int closing;       // Leaving once out is sent
+    int gone;          // Send failed, out is dropped
+} conn;
 
-typedef struct {               // Represents a pool of connected descriptors
-    int maxfd;                 // Largest descriptor in read_set
-    fd_set read_set;           // Set of all active descriptors
-    fd_set ready_set;          // Subset of descriptors ready for reading
-    int nready;                // Number of ready descriptors from select
-    int maxi;                  // High water index into client array
-    int clientfd[FD_SETSIZE];  // Set of active descriptors
-    void *client[FD_SETSIZE];
+typedef struct {           // Represents a pool of connected descriptors
+    int epfd;              // epoll instance watching all of them
+    conn **conns;          // Indexed by descriptor, grown on demand
+    int nconns;            // Size of conns
+    pthread_mutex_t lock;  // Guards conns
+    int (*serve)(int, char *, int, void *);
+    void (*client_exit)(void *);
 } pool;
 
-void init_pool(int listenfd, pool *p) {
-    p->maxi = 1;
-    for (int i = 0; i < FD_SETSIZE; i++) p->clientfd[i] = -1;
+typedef struct {  // A task spawned into a taskgroup
+    void (*fn)(void *);
+    void *arg;
+    taskgroup *g;
+} task;
+
+// work-stealing deque: the owner takes from the bottom, thieves from
+// the top
+typedef struct {
+    void **a;  // Ring buffer of items
+    int cap;   // Size of a, a power of 2
+    int top, bot;
+    pthread_mutex_t lock;
+} deque;
+
+typedef struct {    // A worker thread
+    deque clients;  // Ready clients, served in order
+    deque tasks;    // Tasks spawned by the command it runs
+    int evfd;       // Wakes it up while its fibers wait
+    int polling;    // Waiting on evfd, not on idle
+} worker;
+
+typedef struct {         // A command that can wait without blocking its worker
+    ucontext_t ctx;
+    void (*fn)(void *);  // What it runs, NULL while free
+    void *arg;
+    int fd, events;      // What it waits for, fd -1 for a while
+    int woken;           // By fiber_wake
+    char *kept;          // Its own copy of the kept thread state
+} fiber;
+
+static int nworkers;
+static void (*worker_init)(int);
+static worker *workers;
+static __thread worker *self;  // NULL on threads other than workers
+static int queued;             // Items in all deques
+static pthread_mutex_t idlelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;  // queued > 0
+
+// the fibers of a worker, made on demand and reused
+static __thread fiber *fibers[NFIBER];
+static __thread int nfibers, nbusy;
+static __thread fiber *running;  // NULL on the scheduler
+static __thread ucontext_t sched;
+static __thread int held;
+static __thread struct {
+    void *p;
+    int n;
+} kept[NKEEP];
+static __thread int nkept, keptsize;
+
+void server_workers(int n, void (*init)(int)) {
+    nworkers = n;
+    worker_init = init;
+}
+
+static void dq_push(deque *d, void *x) {
+    pthread_mutex_lock(&d->lock);
+    if (d->bot - d->top == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 64;
+        void **a = malloc(cap * sizeof(void *));
+        for (int i = d->top; i < d->bot; i++)
+            a[i & (cap - 1)] = d->a[i & (d->cap - 1)];
+        free(d->a);
+        d->a = a;
+        d->cap = cap;
+    }
+    d->a[d->bot++ & (d->cap - 1)] = x;
+    pthread_mutex_unlock(&d->lock);
+}
+
+// take an item from the bottom, or the top if steal is set
+// return NULL if empty
+static void *dq_take(deque *d, int steal) {
+    void *x = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->top < d->bot)
+        x = steal ? d->a[d->top++ & (d->cap - 1)]
+                  : d->a[--d->bot & (d->cap - 1)];
+    pthread_mutex_unlock(&d->lock);
+    return x;
+}
+
+// one more item queued, wake an idle worker for it
+// workers with waiting fibers sleep in poll, so wake them too
+static void wake() {
+    __sync_fetch_and_add(&queued, 1);
+    pthread_mutex_lock(&idlelock);
+    pthread_cond_signal(&idle);
+    pthread_mutex_unlock(&idlelock);
+    uint64_t one = 1;
+    for (int i = 0; i < nworkers; i++)
+        if (workers[i].polling &&
+            write(workers[i].evfd, &one, sizeof(one)) < 0)
+            err(1, ERROR "write()");
+}
+
+void fiber_keep(void *p, int n) {
+    assert(nkept < NKEEP && nfibers == 0);
+    kept[nkept].p = p;
+    kept[nkept++].n = n;
+    keptsize += n;
+}
+
+// trade the kept thread state with the copy of f
+static void swapkept(fiber *f) {
+    char *q = f->kept, tmp[256];
+    for (int i = 0; i < nkept; i++)
+        for (int off = 0; off < kept[i].n; off += sizeof(tmp)) {
+            char *p = (char *)kept[i].p + off;
+            int n = kept[i].n - off < sizeof(tmp) ? kept[i].n - off
+                                                  : sizeof(tmp);
+            memcpy(tmp, p, n);
+            memcpy(p, q, n);
+            memcpy(q, tmp, n);
+            q += n;
+        }
+}
+
+// a fiber runs jobs until the worker ends, going back to the scheduler
+// after each
+static void fiber_main() {
+    fiber *f = running;
+    while (1) {
+        f->fn(f->arg);
+        f->fn = NULL;
+        swapcontext(&f->ctx, &sched);
+    }
+}
+
+// run f until it waits or its job ends
+static void resume(fiber *f) {
+    f->woken = 0;
+    swapkept(f);
+    running = f;
+    swapcontext(&sched, &f->ctx);
+    running = NULL;
+    swapkept(f);
+    if (!f->fn) nbusy--;
+}
+
+int fiber_wait(int fd, int events) {
+    if (!running || held) return 0;
+    running->fd = fd;
+    running->events = events;
+    swapcontext(&running->ctx, &sched);
+    return 1;
+}
+
+void *fiber_self() { return running; }
+
+void fiber_wake(void *f) {
+    if (f != running) ((fiber *)f)->woken = 1;
+}
+
+void fiber_hold(int n) { held += n; }
+
+// run fn(arg) on a free fiber, made if needed
+static void fiber_start(void (*fn)(void *), void *arg) {
+    fiber *f = NULL;
+    for (int i = 0; i < nfibers && !f; i++)
+        if (!fibers[i]->fn) f = fibers[i];
+    if (!f) {
+        f = calloc(1, sizeof(fiber));
+        f->kept = calloc(1, keptsize);
+        getcontext(&f->ctx);
+        f->ctx.uc_stack.ss_sp = malloc(STACKSIZE);
+        f->ctx.uc_stack.ss_size = STACKSIZE;
+        makecontext(&f->ctx, fiber_main, 0);
+        fibers[nfibers++] = f;
+    }
+    f->fn = fn;
+    f->arg = arg;
+    nbusy++;
+    resume(f);
+}
+
+// resume the fibers that can go on; wait in poll for their descriptors
+// or new work when none can, a fiber waiting a while is tried each ms
+static void schedule() {
+    struct pollfd pfd[NFIBER + 1];
+    int at[NFIBER];  // where the wait of each fiber is in pfd
+    int np = 0, ready = 0, spin = 0;
+    for (int i = 0; i < nfibers; i++) {
+        fiber *f = fibers[i];
+        at[i] = -1;
+        if (!f->fn) continue;
+        if (f->woken)
+            ready = 1;
+        else if (f->fd < 0)
+            spin = 1;
+        else {
+            at[i] = np;
+            pfd[np++] = (struct pollfd){f->fd, f->events, 0};
+        }
+    }
+    int timeout = ready ? 0 : spin ? 1 : -1;
+    if (timeout && nbusy < NFIBER) {  // it may take new work
+        pfd[np++] = (struct pollfd){self->evfd, POLLIN, 0};
+        self->polling = 1;
+        __sync_synchronize();
+        if (queued > 0) timeout = 0;
+    }
+    if (poll(pfd, np, timeout) < 0 && errno != EINTR) err(1, ERROR "poll()");
+    if (self->polling) {
+        self->polling = 0;
+        uint64_t n;  // reset it
+        if (read(self->evfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+            err(1, ERROR "read()");
+    }
+    for (int i = 0; i < nfibers; i++) {
+        fiber *f = fibers[i];
+        int ev = at[i] >= 0 && pfd[at[i]].revents;
+        if (f->fn && (f->woken || f->fd < 0 || ev)) resume(f);
+    }
+}
+
+// steal a client, or a task if tasks is set, from the other workers
+static void *steal(int tasks) {
+    int me = self ? self - workers : 0;
+    for (int i = 1; i <= nworkers; i++) {
+        worker *w = &workers[(me + i) % nworkers];
+        void *x = dq_take(tasks ? &w->tasks : &w->clients, 1);
+        if (x) return x;
+    }
+    return NULL;
+}
+
+// a task does not switch, the command waiting for it may be held
+static void run(task *t) {
+    __sync_fetch_and_sub(&queued, 1);
+    held++;
+    t->fn(t->arg);
+    held--;
+    taskgroup *g = t->g;
+    free(t);
+    pthread_mutex_lock(&g->lock);
+    if (--g->pending == 0) pthread_cond_broadcast(&g->done);
+    pthread_mutex_unlock(&g->lock);
+}
+
+void task_spawn(taskgroup *g, void (*fn)(void *), void *arg) {
+    if (!self) {  // no one to share with
+        fn(arg);
+        return;
+    }
+    task *t = malloc(sizeof(task));
+    *t = (task){fn, arg, g};
+    pthread_mutex_lock(&g->lock);
+    g->pending++;
+    pthread_mutex_unlock(&g->lock);
+    dq_push(&self->tasks, t);
+    wake();
+}
+
+// tasks of g not stolen yet are run here, last spawned first
+// only tasks are taken while waiting, a client would run in the middle
+// of the command holding its locks
+void task_wait(taskgroup *g) {
+    task *t;
+    while (self && (t = dq_take(&self->tasks, 0))) run(t);
+    pthread_mutex_lock(&g->lock);
+    while (g->pending > 0) {
+        pthread_mutex_unlock(&g->lock);
+        int waited = fiber_wait(-1, 0);
+        pthread_mutex_lock(&g->lock);
+        if (!waited && g->pending > 0) pthread_cond_wait(&g->done, &g->lock);
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+// watch fd for events, edge-triggered: a wakeup only comes with new
+// input or room for output, so the reader must take all of it
+// a client is reported once, until check_client arms it again, so only
+// one worker serves it at a time
+static void watch(pool *p, int fd, void *ptr, int op, int events) {
+    struct epoll_event ev = {.events = events | EPOLLET};
+    if (ptr) {
+        ev.events |= EPOLLONESHOT;
+        ev.data.ptr = ptr;
+    } else {
+        ev.data.ptr = p;  // the listening socket
+    }
+    if (epoll_ctl(p->epfd, op, fd, &ev)) err(1, ERROR "epoll_ctl()");
+}
 
-    p->maxfd = listenfd;
-    FD_ZERO(&p->read_set);
-    FD_SET(listenfd, &p->read_set);
+void init_pool(int listenfd, pool *p) {
+    p->epfd = epoll_create1(0);
+    if (p->epfd < 0) err(1, ERROR "epoll_create1()");
+    p->conns = NULL;
+    p->nconns = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    watch(p, listenfd, NULL, EPOLL_CTL_ADD, EPOLLIN);
 }
 
 void add_clients(int connfd, pool *p, void *(*client_init)(int)) {
-    int i;
-    p->nready--;
-    for (i = 0; i < FD_SETSIZE; i++) {
-        if (p->clientfd[i] < 0) {
-            p->clientfd[i] = connfd;
-            p->client[i] = client_init(connfd);
-            printf("New client: %d\n", connfd);
-            FD_SET(connfd, &p->read_set);
-            if (connfd > p->maxfd) p->maxfd = connfd;
-            if (i > p->maxi) p->maxi = i;
-            break;
+    conn *c = calloc(1, sizeof(conn));
+    c->fd = connfd;
+    c->client = client_init(connfd);
+    pthread_mutex_lock(&p->lock);
+    if (connfd >= p->nconns) {
+        int n = p->nconns ? p->nconns : 64;
+        while (n <= connfd) n *= 2;
+        p->conns = realloc(p->conns, n * sizeof(conn *));
+        for (int i = p->nconns; i < n; i++) p->conns[i] = NULL;
+        p->nconns = n;
+    }
+    p->conns[connfd] = c;
+    pthread_mutex_unlock(&p->lock);
+    printf("New client: %d\n", connfd);
+    watch(p, connfd, c, EPOLL_CTL_ADD, EPOLLIN);
+}
+
+// the client being served, for recvraw and sendraw
+static __thread conn *cur;
+// the line being served, serve may write two bytes past it
+static __thread char *line;
+static __thread int linecap;
+
+// send queued output until at most left bytes are left
+// with MSG_DONTWAIT in flags, stop when the socket is full
+// return -1 if the client is gone
+static int flush_out(conn *c, int left, int flags) {
+    while (c->outlen > left) {
+        int n = send(c->fd, c->out + c->outoff, c->outlen,
+                     flags | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            c->gone = 1;
+            c->outoff = c->outlen = 0;
+            return -1;
+        }
+        c->outoff += n;
+        c->outlen -= n;
+    }
+    if (c->outlen == 0) c->outoff = 0;
+    return 0;
+}
+
+int sendraw(const void *src, int n) {
+    conn *c = cur;
+    if (c->gone) return -1;
+    if (c->outoff + c->outlen + n > c->outcap) {
+        memmove(c->out, c->out + c->outoff, c->outlen);
+        c->outoff = 0;
+        if (c->outlen + n > c->outcap) {
+            while (c->outlen + n > c->outcap)
+                c->outcap = c->outcap ? c->outcap * 2 : BUFSIZE;
+            c->out = realloc(c->out, c->outcap);
+        }
+    }
+    memcpy(c->out + c->outoff + c->outlen, src, n);
+    c->outlen += n;
+    // a command with a lot to say waits for the client to take some
+    while (c->outlen > OUTHIGH) {
+        int waited = fiber_wait(c->fd, POLLOUT);
+        if (flush_out(c, OUTHIGH / 2, waited ? MSG_DONTWAIT : 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int sendrawv(const struct iovec *iov, int n) {
+    conn *c = cur;
+    if (c->gone) return -1;
+    if (c->outlen && flush_out(c, 0, MSG_DONTWAIT) < 0) return -1;
+    int sent = 0;
+    if (c->outlen == 0) {  // in order, so only with nothing before it
+        struct msghdr mh = {.msg_iov = (struct iovec *)iov, .msg_iovlen = n};
+        sent = sendmsg(c->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR) {
+            c->gone = 1;
+            return -1;
+        }
+        if (sent < 0) sent = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        int skip = sent < iov[i].iov_len ? sent : iov[i].iov_len;
+        sent -= skip;
+        if (iov[i].iov_len > skip &&
+            sendraw((char *)iov[i].iov_base + skip, iov[i].iov_len - skip) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int recvraw(char *dst, int n) {
+    int got = n < cur->inlen ? n : cur->inlen;
+    memcpy(dst, cur->in + cur->inoff, got);
+    cur->inoff += got;
+    cur->inlen -= got;
+    while (got < n) {
+        int waited = fiber_wait(cur->fd, POLLIN);
+        int r = recv(cur->fd, dst + got, n - got, waited ? MSG_DONTWAIT : 0);
+        if (r < 0 && waited && (errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+        if (r <= 0) return -1;
+        got += r;
+    }
+    return n;
+}
+
+// serve the complete lines kept for the client, in order
+// a line may be cut by the end of the input, then it is kept for the
+// next read, unless last is set
+// stop while the client has too much output waiting
+// return -1 if the client asks to leave
+static int serve_lines(pool *p, conn *c, int last) {
+    while (c->inlen > 0 && c->outlen <= OUTMAX) {
+        char *start = c->in + c->inoff;
+        char *nl = memchr(start, '\n', c->inlen);
+        if (!nl && !last) break;  // wait for the rest
+        int len = nl ? nl - start : c->inlen;
+        if (len + 2 > linecap) {
+            linecap = len + 2 > BUFSIZE ? len + 2 : BUFSIZE;
+            line = realloc(line, linecap);
         }
+        memcpy(line, start, len);
+        c->inoff += nl ? len + 1 : len;
+        c->inlen -= nl ? len + 1 : len;
+        if (len > 0 && line[len - 1] == '\r') len--;
+        if (len == 0) continue;
+        // serve may take raw bytes after the line by recvraw
+        if (p->serve(c->fd, line, len, c->client) < 0) return -1;
     }
-    if (i == FD_SETSIZE) errx(1, ERROR "Too many clients");
-}
-
-void check_clients(pool *p, int (*serve)(int, char *, int, void *)) {
-    int i, connfd, n;
-    static char buf[BUFSIZE];
-
-    for (i = 0; (i <= p->maxi) && (p->nready > 0); i++) {
-        connfd = p->clientfd[i];
-
-        if ((connfd > 0) && (FD_ISSET(connfd, &p->ready_set))) {
-            p->nready--;
-            int exit = 1;
-            n = recv(connfd, buf, BUFSIZE, 0);
-            if (n > 0) {
-                buf[n] = 0;
-                printf("Server received %d bytes on fd %d\n", n, connfd);
-                exit = 0;
-                char *ptr = NULL;
-                char *s = strtok_r(buf, "\r\n", &ptr);
-                while (s) {
-                    if (serve(connfd, s, strlen(s), p->client[i]) < 0) exit = 1;
-                    s = strtok_r(NULL, "\r\n", &ptr);
-                }
-            } else if (n < 0) {
-                printf("recv() error\n");
+    return 0;
+}
+
+// send what the client can take, read what it has sent into its input
+// buffer, and serve every complete command, until it has no more input,
+// too much output waiting, or is gone
+// commands may come many at a time, and be cut anywhere by the reads
+void check_client(pool *p, conn *c) {
+    int connfd = c->fd, exit = 0;
+    cur = c;
+
+    while (!exit) {
+        if (flush_out(c, 0, MSG_DONTWAIT) < 0) {
+            exit = 1;
+            break;
+        }
+        // paused until the client reads, no more input is taken either,
+        // so a client sending too fast is held up by its own socket
+        if (c->outlen > OUTMAX || c->closing) break;
+        if (serve_lines(p, c, c->eof) < 0) {
+            c->closing = 1;
+            continue;  // send the goodbye
+        }
+        if (c->outlen > OUTMAX) continue;
+        if (c->eof) {  // all served, it may still read the replies
+            c->closing = 1;
+            continue;
+        }
+        // make room after the kept input
+        if (c->inoff > 0) {
+            memmove(c->in, c->in + c->inoff, c->inlen);
+            c->inoff = 0;
+        }
+        if (c->inlen == c->incap) {
+            if (c->incap >= MAXLINE) {
+                printf("Line too long on fd %d\n", connfd);
                 exit = 1;
+                break;
+            }
+            c->incap = c->incap ? c->incap * 2 : BUFSIZE;
+            c->in = realloc(c->in, c->incap);
+        }
+        // the socket stays blocking for recvraw
+        int n = recv(connfd, c->in + c->inlen, c->incap - c->inlen,
+                     MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {  // all read
+                if (flush_out(c, 0, MSG_DONTWAIT) < 0) exit = 1;
+                break;
+            }
+            if (errno == EINTR) continue;
+            printf("recv() error\n");
+            exit = 1;
+        } else if (n == 0) {
+            c->eof = 1;  // a last line without newline is served too
+        } else {
+            printf("Server received %d bytes on fd %d\n", n, connfd);
+            c->inlen += n;
+        }
+    }
+    if (c->inlen == 0) {  // keep idle clients small
+        free(c->in);
+        c->in = NULL;
+        c->inoff = c->incap = 0;
+    }
+    if (c->outlen == 0) {
+        free(c->out);
+        c->out = NULL;
+        c->outcap = 0;
+        if (c->closing) exit = 1;
+    }
+    if (!exit) {
+        // input that came meanwhile, or room for output, wakes it up again
+        int events = c->outlen ? EPOLLOUT : 0;
+        if (c->outlen <= OUTMAX && !c->closing && !c->eof) events |= EPOLLIN;
+        watch(p, connfd, c, EPOLL_CTL_MOD, events);
+        return;
+    }
+    p->client_exit(c->client);
+    pthread_mutex_lock(&p->lock);
+    p->conns[connfd] = NULL;
+    pthread_mutex_unlock(&p->lock);
+    close(connfd);  // also leaves the epoll set, the fd may be reused now
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static pool *workpool;  // Served by the workers
+
+static void serve_client(void *c) { check_client(workpool, c); }
+
+// serve ready clients, its own first, then stolen ones, each on a fiber
+// of its own while there are free ones
+// tasks are stolen too, to help a long command of another worker
+static void *work(void *arg) {
+    static int nextid;
+    int id = __sync_fetch_and_add(&nextid, 1);
+    self = &workers[id];
+    fiber_keep(&cur, sizeof(cur));
+    fiber_keep(&line, sizeof(line));
+    fiber_keep(&linecap, sizeof(linecap));
+    if (worker_init) worker_init(id);
+    while (1) {
+        if (nbusy < NFIBER) {
+            conn *c = dq_take(&self->clients, 1);
+            if (!c) c = steal(0);
+            if (c) {
+                __sync_fetch_and_sub(&queued, 1);
+                fiber_start(serve_client, c);
+                continue;
             }
-            if (exit) {
-                close(connfd);
-                FD_CLR(connfd, &p->read_set);
-                p->clientfd[i] = -1;
-                if (p->client[i]) free(p->client[i]);
+            task *t = steal(1);
+            if (t) {
+                run(t);
+                continue;
             }
         }
+        if (nbusy > 0) {
+            schedule();
+            continue;
+        }
+        pthread_mutex_lock(&idlelock);
+        while (queued == 0) pthread_cond_wait(&idle, &idlelock);
+        pthread_mutex_unlock(&idlelock);
+    }
+    return NULL;
+}
+
+// hand a ready client to a worker, or serve it here without workers
+// clients go round the workers, idle ones steal from busy ones
+static void dispatch(pool *p, conn *c) {
+    static int next;
+    if (nworkers == 0) {
+        check_client(p, c);
+        return;
     }
+    dq_push(&workers[next++ % nworkers].clients, c);
+    wake();
 }
 
 void mainloop(int port, void *(*client_init)(int),
-              int (*serve)(int, char *, int, void *)) {
+              int (*serve)(int, char *, int, void *),
+              void (*client_exit)(void *)) {
     // create listen socket
     int sockfd;
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -92,22 +623,52 @@ void mainloop(int port, void *(*client_init)(int),
     if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)))
         err(1, ERROR "bind()");
 
-    // start listening
-    if (listen(sockfd, 5)) err(1, ERROR "listen()");
+    // start listening, accept takes all pending clients on each wakeup
+    if (listen(sockfd, SOMAXCONN)) err(1, ERROR "listen()");
+    if (fcntl(sockfd, F_SETFL, O_NONBLOCK)) err(1, ERROR "fcntl()");
 
     printf("Start listening on port %d...\n", port);
     static pool pool;
     init_pool(sockfd, &pool);
+    pool.serve = serve;
+    pool.client_exit = client_exit;
+    workpool = &pool;
+    workers = calloc(nworkers, sizeof(worker));
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&workers[i].clients.lock, NULL);
+        pthread_mutex_init(&workers[i].tasks.lock, NULL);
+        workers[i].evfd = eventfd(0, EFD_NONBLOCK);
+        if (workers[i].evfd < 0) err(1, ERROR "eventfd()");
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, work, NULL))
+            errx(1, ERROR "pthread_create()");
+        pthread_detach(t);
+    }
+    struct epoll_event ev[MAXEVENTS];
     while (1) {
-        pool.ready_set = pool.read_set;
-        pool.nready = select(pool.maxfd + 1, &pool.ready_set, NULL, NULL, NULL);
-        if (FD_ISSET(sockfd, &pool.ready_set)) {
-            // handle new client
-            int connfd = accept(sockfd, NULL, NULL);
-            if (connfd < 0) err(1, ERROR "accept()");
-            add_clients(connfd, &pool, client_init);
+        int nready = epoll_wait(pool.epfd, ev, MAXEVENTS, -1);
+        if (nready < 0) {
+            if (errno == EINTR) continue;
+            err(1, ERROR "epoll_wait()");
+        }
+        for (int i = 0; i < nready; i++) {
+            if (ev[i].data.ptr != &pool) {
+                dispatch(&pool, ev[i].data.ptr);
+                continue;
+            }
+            // handle new clients, accepted sockets are blocking
+            while (1) {
+                int connfd = accept(sockfd, NULL, NULL);
+                if (connfd >= 0)
+                    add_clients(connfd, &pool, client_init);
+                else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                else if (errno != EINTR && errno != ECONNABORTED)
+                    err(1, ERROR "accept()");
+            }
         }
-        check_clients(&pool, serve);
     }
     close(sockfd);
-}
\ No newline at end of file
+}
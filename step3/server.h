@@ -8,19 +8,70 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "common.h"
 
+// serve clients on n worker threads, each calling init with its number
+// first; without this, clients are served on the thread of mainloop
+// a client is served by one worker at a time, ready clients are spread
+// over the workers, and idle workers steal clients and tasks from busy ones
+void server_workers(int n, void (*init)(int));
+// on the workers each command runs as a fiber, so a command waiting for
+// I/O lets the other commands of its worker go on
+// keep the n bytes of thread-local state at p apart for each fiber;
+// called by the init of a worker
+void fiber_keep(void *p, int n);
+// let the other fibers of the worker run until fd has events, or a
+// while if fd is -1, or fiber_wake; it may return early, check again
+// return 0 at once off a fiber or while held
+int fiber_wait(int fd, int events);
+// the running fiber, NULL off a fiber
+void *fiber_self();
+// end the wait of fiber f, from the same worker
+void fiber_wake(void *f);
+// a fiber must not switch while it holds what the other fibers of its
+// worker may block on, like a mutex: held n more times, or less
+void fiber_hold(int n);
+// tasks spawned by a command, waited for together
+typedef struct {
+    int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} taskgroup;
+#define TASKGROUP_INIT {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER}
+// run fn(arg) as part of g, on an idle worker that steals it or on the
+// caller at task_wait; off the workers it runs right away
+// a stolen task runs in the middle of another command, so it must not
+// wait on any lock a command may hold
+void task_spawn(taskgroup *g, void (*fn)(void *), void *arg);
+// wait until all tasks of g are done
+void task_wait(taskgroup *g);
+// client_init makes the state of a new client, passed to serve, and
+// client_exit releases it when the client is gone
 void mainloop(int port, void *(*client_init)(int),
-          int (*serve)(int, char *, int, void *));
+              int (*serve)(int, char *, int, void *),
+              void (*client_exit)(void *));
+// read exactly n raw bytes sent by the client being served
+// return n, or -1 if the client is gone
+int recvraw(char *dst, int n);
+// queue n bytes of reply to the client being served, sent as the client
+// takes them; past a high mark, wait until the client has taken some
+// return 0, or -1 if the client is gone
+int sendraw(const void *src, int n);
+// like sendraw for n pieces; when nothing is queued they are sent from
+// where they are, and only what the socket does not take is queued
+int sendrawv(const struct iovec *iov, int n);
 
 #endif
\ No newline at end of file